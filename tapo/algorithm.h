@@ -3,39 +3,61 @@
 
 #include "tcp_base.h"
 
-// including
-int left_bound(uint32_t *array, int n, uint32_t val)
+// sorted arrays of sequence numbers, with duplicates
+
+// including, the first element not before val
+static inline int left_bound(const uint32_t *array, int n, uint32_t val)
 {
 	int low = 0, high = n, mid;
 	while (low < high) {
-		mid = (low+high)/2;
-		if (after(val, array[mid]))
+		mid = low + (high - low)/2;
+		if (before(array[mid], val))
 			low = mid+1;
-		else if (before(val, array[mid]))
-			high = mid-1;
 		else
-			return mid;
+			high = mid;
 	}
-	
-	if (low == n || !before(array[low], val))
-		return low;
-	else
-		return low+1;
+
+	return low;
 }
 
-// excluding
-int right_bound(uint32_t *array, int n, uint32_t val)
+// excluding, the first element after val
+static inline int right_bound(const uint32_t *array, int n, uint32_t val)
 {
-	int pos = left_bound(array, n, val);
-	while (pos > 0 && (!after(val, array[pos])))
-		pos -= 1;
+	int low = 0, high = n, mid;
+	while (low < high) {
+		mid = low + (high - low)/2;
+		if (after(array[mid], val))
+			high = mid;
+		else
+			low = mid+1;
+	}
 
-	return pos;
+	return low;
 }
 
-int array_range(uint32_t *array, int n, uint32_t left, uint32_t right)
+// elements in [left, right)
+static inline int array_range(const uint32_t *array, int n, uint32_t left, uint32_t right)
 {
 	return left_bound(array, n, right) - left_bound(array, n, left);
 }
 
+// elements equal to val
+static inline int array_count(const uint32_t *array, int n, uint32_t val)
+{
+	return right_bound(array, n, val) - left_bound(array, n, val);
+}
+
+/*
+ * left_bound() of val given that of a previous value, pos. Values going up
+ * walk forward from pos, so a sweep of increasing values costs O(n) in all.
+ */
+static inline int next_left_bound(const uint32_t *array, int n, int pos, uint32_t val)
+{
+	if (pos > 0 && !after(val, array[pos-1]))
+		return left_bound(array, n, val);
+	while (pos < n && before(array[pos], val))
+		pos += 1;
+	return pos;
+}
+
 #endif
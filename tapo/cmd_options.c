@@ -2,29 +2,69 @@
 #include <stdio.h> 
 #include <unistd.h> 
 #include <string.h>
+#include <glob.h>
+#include <getopt.h>
 
 #include "def.h"
 
 #include "cmd_options.h"
+#include "output.h"
 
 int pcap_type = Undetermined;
-char pcap_filename[1024] = { 0 };
+char **pcap_files = NULL;
+int pcap_file_num = 0;
 char pcap_intf[128] = { 0 };
 int pcap_limit = 0;
 int file_type = 0;
+int worker_num = 1;
+int idle_timeout = -1;
+int output_kinds = DEFAULT_OUTPUT_KINDS;
+int64_t snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+char series_path[1024] = { 0 };
+int build_index = 0;
+char query_from[64] = { 0 };
+char query_to[64] = { 0 };
+char query_flow[64] = { 0 };
+int rtt_source = RTT_SEQ;
+const char *rules_paths[MAX_RULE_FILES];
+int rules_path_num = 0;
 
 char server_ip[128] = { 0 };
-uint16_t server_port;
+char server_port[128] = { 0 };
+char server_file[1024] = { 0 };
+
+static glob_t file_glob;
 
 #define _(x) x
 
 const char *usage = 
 	"Usage:\n"
-	"    " PROG_NAME " [ -f pcap_file | -i pcap_intf ] -s server_ip -p server_ip { -c count }\n"
+	"    " PROG_NAME " [ -f pcap_file | -i pcap_intf ] [ -s server_ip -p server_port | -S server_file ] { -c count } { -j workers } { -e idle_timeout }\n"
+	"        { -O series,snapshot,summary } { -I snapshot_interval } { -w series_file }\n"
+	"        { --from time } { --to time } { --flow ip:port,ip:port } { --rtt seq|ts } { --rules rule_file }\n"
+	"    " PROG_NAME " --build-index -f pcap_file\n"
 	"\n"
 	"Examples:\n"
 	"    " PROG_NAME " -f file.pcap -s 10.21.0.202 -p 80\n"
-	"    " PROG_NAME " -i eth0 -s 10.21.0.202 -p 80 -c 10000\n";
+	"    " PROG_NAME " -i eth0 -s 10.21.0.202 -p 80 -c 10000 -e 300\n"
+	"    " PROG_NAME " -f file.pcap -s 10.21.0.202 -p 80 -j 4\n"
+	"    " PROG_NAME " -i eth0 -s 10.21.0.202 -p 80 -O snapshot,summary -I 10\n"
+	"    " PROG_NAME " -f file.pcap -s 10.21.0.202 -p 80 -w series.bin\n"
+	"    " PROG_NAME " -f file.pcap -s 10.21.0.0/24 -p 80,8000-8100\n"
+	"    " PROG_NAME " -f file.pcap -S servers.txt\n"
+	"    " PROG_NAME " -f 'cap-*.pcap' -f extra.pcap -s 10.21.0.202 -p 80\n"
+	"    " PROG_NAME " -f file.pcap -s 10.21.0.202 -p 80 --from +3600 --to +3660 --flow 10.21.0.202:80,10.1.2.3:40000\n"
+	"\n"
+	"Several -f files, or a quoted pattern, are read as one capture in timestamp order.\n"
+	"Files compressed by gzip, zstd or lz4 are decompressed while they are read.\n"
+	"--from/--to take seconds since the epoch, or since the first packet with a '+', and\n"
+	"read the capture through the index written by --build-index.\n"
+	"--rtt ts samples the RTT from the timestamp echo of the ACKs, also in recovery;\n"
+	"flows without the timestamp option fall back to the sequence numbers.\n"
+	"--rules classifies the stalls of the summary by the rules of rule_file, see parser/rules.txt.\n"
+	"Given several times, every stall is classified by all the files in the same pass, and a\n"
+	"table of the stall types of every file against those of the first one ends the output.\n"
+	"A line of server_file is a prefix and its ports, e.g. \"10.21.0.0/24 80,443\".\n";
 
 static void print_version()
 {
@@ -37,20 +77,67 @@ static void usage_exit(int status)
 	exit(status);
 }
 
+// comma separated kinds of output, e.g. "series,summary"
+static int parse_output_kinds(const char *arg)
+{
+	static const struct {
+		const char *name;
+		int kind;
+	} kinds[] = {
+		{ "series", OUT_SERIES },
+		{ "snapshot", OUT_SNAPSHOT },
+		{ "summary", OUT_SUMMARY },
+	};
+
+	int result = 0;
+	while (*arg != '\0') {
+		size_t len = strcspn(arg, ",");
+		int i = 0;
+		for (; i < sizeof(kinds)/sizeof(kinds[0]); i++) {
+			if (strlen(kinds[i].name) == len && strncmp(arg, kinds[i].name, len) == 0)
+				break;
+		}
+		if (i == sizeof(kinds)/sizeof(kinds[0]))
+			return -1;
+
+		result |= kinds[i].kind;
+		arg += len;
+		if (*arg == ',')
+			arg++;
+	}
+
+	return result;
+}
+
 void parse_cmd_options(int argc, const char **argv)
 {
 	int sflag = 0;
 	int pflag = 0;
-	const char* options = "hvf:i:s:p:c:t:";
-	char cmd_opt;
+	const char* options = "hvf:i:s:p:S:c:t:j:e:O:I:w:";
+	enum { OPT_BUILD_INDEX = 256, OPT_FROM, OPT_TO, OPT_FLOW, OPT_RTT, OPT_RULES };
+	static const struct option long_options[] = {
+		{ "build-index", no_argument, NULL, OPT_BUILD_INDEX },
+		{ "from", required_argument, NULL, OPT_FROM },
+		{ "to", required_argument, NULL, OPT_TO },
+		{ "flow", required_argument, NULL, OPT_FLOW },
+		{ "rtt", required_argument, NULL, OPT_RTT },
+		{ "rules", required_argument, NULL, OPT_RULES },
+		{ NULL, 0, NULL, 0 },
+	};
+	int cmd_opt;
 
-	while ((cmd_opt = getopt(argc, (char **)argv, options)) != -1) {
+	while ((cmd_opt = getopt_long(argc, (char **)argv, options, long_options, NULL)) != -1) {
 		switch (cmd_opt) {	
 			case 'f':
 				if (pcap_type == Online)
 					usage_exit(1);
 
-				strncpy(pcap_filename, optarg, sizeof(pcap_filename)-1);
+				// a pattern matching no file is kept, opening it reports the error
+				if (glob(optarg, GLOB_NOCHECK | (pcap_type == Offline ? GLOB_APPEND : 0),
+							NULL, &file_glob) != 0)
+					usage_exit(1);
+				pcap_files = file_glob.gl_pathv;
+				pcap_file_num = file_glob.gl_pathc;
 				pcap_type = Offline;
 				break;
 
@@ -68,16 +155,78 @@ void parse_cmd_options(int argc, const char **argv)
 				break;
 
 			case 'p':
-				if (sscanf(optarg, "%hu", &server_port) != 1)
-					usage_exit(1);
+				strncpy(server_port, optarg, sizeof(server_port)-1);
 				pflag = 1;
 				break;
 
+			case 'S':
+				strncpy(server_file, optarg, sizeof(server_file)-1);
+				break;
+
 			case 'c':
 				if (sscanf(optarg, "%d", &pcap_limit) != 1)
 					usage_exit(1);
 				break;
 			
+			case 'j':
+				if (sscanf(optarg, "%d", &worker_num) != 1 || worker_num < 1)
+					usage_exit(1);
+				break;
+
+			case 'e':
+				if (sscanf(optarg, "%d", &idle_timeout) != 1 || idle_timeout < 0)
+					usage_exit(1);
+				break;
+
+			case 'O':
+				if ((output_kinds = parse_output_kinds(optarg)) < 0)
+					usage_exit(1);
+				break;
+
+			case 'I': {
+				double sec;
+				if (sscanf(optarg, "%lf", &sec) != 1 || sec <= 0)
+					usage_exit(1);
+				// the interval is compared with capture times in nanoseconds
+				snapshot_interval = (int64_t)(sec * 1000000000LL + 0.5);
+				break;
+			}
+
+			case 'w':
+				strncpy(series_path, optarg, sizeof(series_path)-1);
+				break;
+
+			case OPT_BUILD_INDEX:
+				build_index = 1;
+				break;
+
+			case OPT_FROM:
+				strncpy(query_from, optarg, sizeof(query_from)-1);
+				break;
+
+			case OPT_TO:
+				strncpy(query_to, optarg, sizeof(query_to)-1);
+				break;
+
+			case OPT_FLOW:
+				strncpy(query_flow, optarg, sizeof(query_flow)-1);
+				break;
+
+			case OPT_RTT:
+				if (strcmp(optarg, "seq") == 0)
+					rtt_source = RTT_SEQ;
+				else if (strcmp(optarg, "ts") == 0)
+					rtt_source = RTT_TS;
+				else
+					usage_exit(1);
+				break;
+
+			case OPT_RULES:
+				if (rules_path_num == MAX_RULE_FILES)
+					usage_exit(1);
+				rules_paths[rules_path_num++] = optarg;
+				break;
+
 			case 't':
 				if (strcmp(optarg, "down") == 0)
 					file_type = DOWNLOAD;
@@ -101,6 +250,14 @@ void parse_cmd_options(int argc, const char **argv)
 		}
 	}
 
-	if (pcap_type == Undetermined || !sflag || !pflag)
+	// the index does not depend on the servers
+	if (build_index && pcap_type == Offline)
+		return;
+
+	if (pcap_type == Undetermined || sflag != pflag || (!sflag && server_file[0] == '\0'))
 		usage_exit(1);
+
+	// live captures run for long, idle flows must not stay forever
+	if (idle_timeout < 0)
+		idle_timeout = (pcap_type == Online) ? DEFAULT_IDLE_TIMEOUT : 0;
 }
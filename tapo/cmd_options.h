@@ -8,15 +8,39 @@
 
 enum { Undetermined, Online, Offline };
 
+// where the RTT samples come from, see --rtt
+enum { RTT_SEQ, RTT_TS };
+
+// seconds, for live captures
+#define DEFAULT_IDLE_TIMEOUT 300
+
 extern int pcap_type;
-extern char pcap_filename[1024];
+// the files of -f, merged by timestamp if there are several
+extern char **pcap_files;
+extern int pcap_file_num;
 extern char pcap_intf[128];
 extern int pcap_limit;
 extern int file_type;
+extern int worker_num;
+extern int idle_timeout;
+extern int output_kinds;
+extern int64_t snapshot_interval; // nanoseconds
+extern char series_path[1024];
+// see pcap_index.h
+extern int build_index;
+extern char query_from[64];
+extern char query_to[64];
+extern char query_flow[64];
+extern int rtt_source;
+// see rule_engine.h
+#define MAX_RULE_FILES 8
+extern const char *rules_paths[MAX_RULE_FILES];
+extern int rules_path_num;
 
 
 extern char server_ip[128];
-extern uint16_t server_port;
+extern char server_port[128];
+extern char server_file[1024];
 
 void parse_cmd_options(int argc, const char** argv);
 
@@ -9,6 +9,8 @@
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define MAX(x,y) ((x)>(y)?(x):(y))
 
+#define CACHE_LINE_SIZE 64
+
 #define DIV_CEIL(seg, size) (((seg)+size-1)/size)
 
 
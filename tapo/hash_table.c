@@ -2,136 +2,252 @@
 #include "def.h"
 #include "log.h"
 #include "malloc.h"
+#include "cmd_options.h"
 
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include <errno.h>
 
-// in buf, skip s bits, then read n bits
-// ensure len(buf)*8 >= (n+s) and n <= 32
-static inline int read_nbits(unsigned char *buf, int n, int s)
+static inline uint32_t hash(struct tcp_key *key)
 {
-	buf += s/8;
-	s %= 8;
-	int m = 0;
-	int val = 0;
-	if (s > 0) {
-		m = 8-s;
-		val = (*buf) & ((1 << m)-1);
-		buf += 1;
-	}
-
-	if (m > n) {
-		val >>= (m-n);
-		return val;
-	}
-	n -= m;
+	uint64_t a;
+	uint32_t b;
+	memcpy(&a, key, sizeof(a));
+	memcpy(&b, (char *)key + sizeof(a), sizeof(b));
 
-	while (n > 0) {
-		m = MIN(8, n);
-		val = (val << m) | (*buf) >> (8-m);
-		buf += 1;
-		n -= m;
-	}
+	uint64_t h = (a ^ ((uint64_t)b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
 
-	return val;
+	// 0 marks an empty slot
+	return (uint32_t)h | 1;
 }
 
-static inline int hash(struct tcp_key *key)
+static inline int key_equal(struct tcp_key *k1, struct tcp_key *k2)
 {
-	assert(BITS < 24);
-
-	int val = 0;
-	int shift = 3;
-	int size = sizeof(struct tcp_key)*8;
-	unsigned char *buf = (unsigned char *)key;
-	int i = 0;
-	while (i < size) {
-		int n = MIN(BITS, size-i);
-		int t = read_nbits(buf, n, i);
-		val ^= ((t << shift)&((1<<BITS)-1)) | (t >> shift);
-		i += n;
-	}
+	return memcmp(k1, k2, sizeof(struct tcp_key)) == 0;
+}
 
-	return val;
+// how far the entry in slot i is from its home slot
+static inline uint32_t probe_dist(struct hash_table *ht, uint32_t hv, uint32_t i)
+{
+	return (i - hv) & ht->mask;
 }
 
-struct hash_table_entry **new_hash_table()
+static struct hash_slot *new_slots(uint32_t size)
 {
-	struct hash_table_entry **ht = MALLOC_N(struct hash_table_entry *, HASH_TABLE_SIZE);
-	if (ht == NULL) {
+	struct hash_slot *slots = MALLOC_N(struct hash_slot, size);
+	if (slots == NULL) {
 		LOG(ERROR, "malloc hash table failed: %s\n", strerror(errno));
 		exit(1);
 	}
 
+	return slots;
+}
+
+struct hash_table *new_hash_table()
+{
+	struct hash_table *ht = MALLOC_N(struct hash_table, 1);
+	ht->slots = new_slots(1 << HASH_TABLE_INIT_BITS);
+	ht->mask = (1 << HASH_TABLE_INIT_BITS) - 1;
+	ht->num = 0;
+
+	if (idle_timeout > 0) {
+		ht->wheel = MALLOC_N(struct timer_wheel, 1);
+		init_timer_wheel(ht->wheel);
+	}
+
 	return ht;
 }
 
-struct tcp_state *find_ts_entry(struct hash_table_entry **hash_table, struct tcp_key *key)
+struct tcp_state *find_ts_entry(struct hash_table *ht, struct tcp_key *key)
 {
-	struct hash_table_entry *entry = hash_table[hash(key)];
-	while (entry) {
-		if (memcmp(&entry->ts->key, key, sizeof(struct tcp_key)) == 0)
-			return entry->ts;
-		entry = entry->next;
+	uint32_t hv = hash(key);
+	uint32_t i = hv & ht->mask, d = 0;
+	while (1) {
+		struct hash_slot *slot = &ht->slots[i];
+		// an entry closer to its home slot means the key is absent
+		if (slot->hash == 0 || probe_dist(ht, slot->hash, i) < d)
+			return NULL;
+		if (slot->hash == hv && key_equal(&slot->key, key))
+			return slot->ts;
+
+		i = (i + 1) & ht->mask;
+		d += 1;
 	}
+}
 
-	return NULL;
+/*
+ * Prefetch hints for a batch of packets: prefetch the home slots of all
+ * the keys first, then the flows found in them, so the misses of the batch
+ * overlap. The flows found are handed to the packets, see ht->gen.
+ */
+void prefetch_ts_slot(struct hash_table *ht, struct tcp_key *key)
+{
+	__builtin_prefetch(&ht->slots[hash(key) & ht->mask]);
 }
 
-int insert_ts_entry(struct hash_table_entry **hash_table, struct tcp_state *ts)
+struct tcp_state *prefetch_ts_entry(struct hash_table *ht, struct tcp_key *key)
 {
-	int hv = hash(&ts->key);
+	struct tcp_state *ts = find_ts_entry(ht, key);
+	// the hot fields up to the rings, see struct tcp_state
+	if (ts != NULL) {
+		char *p = (char *)ts;
+		size_t off = 0;
+		for (; off < offsetof(struct tcp_state, retrans_list); off += CACHE_LINE_SIZE)
+			__builtin_prefetch(p + off, 1);
+	}
 
-	struct hash_table_entry *entry = MALLOC(struct hash_table_entry);
-	entry->ts = ts;
-	entry->next = hash_table[hv];
-	hash_table[hv] = entry;
+	return ts;
+}
+
+static void place_entry(struct hash_table *ht, struct hash_slot *entry)
+{
+	struct hash_slot cur = *entry;
+	uint32_t i = cur.hash & ht->mask, d = 0;
+	while (1) {
+		struct hash_slot *slot = &ht->slots[i];
+		if (slot->hash == 0) {
+			*slot = cur;
+			return;
+		}
+
+		// robin hood: take the slot of a richer entry
+		uint32_t sd = probe_dist(ht, slot->hash, i);
+		if (sd < d) {
+			swap(*slot, cur);
+			d = sd;
+		}
+
+		i = (i + 1) & ht->mask;
+		d += 1;
+	}
+}
+
+static void grow_hash_table(struct hash_table *ht)
+{
+	struct hash_slot *old = ht->slots;
+	uint32_t old_size = ht->mask + 1, i = 0;
+
+	ht->slots = new_slots(old_size * 2);
+	ht->mask = old_size * 2 - 1;
+	for (; i < old_size; i++) {
+		if (old[i].hash != 0)
+			place_entry(ht, &old[i]);
+	}
+
+	FREE_N(old);
+}
+
+int insert_ts_entry(struct hash_table *ht, struct tcp_state *ts)
+{
+	if (ht->num + 1 > HASH_TABLE_LOAD(ht->mask + 1))
+		grow_hash_table(ht);
+
+	struct hash_slot entry;
+	memcpy(&entry.key, &ts->key, sizeof(struct tcp_key));
+	entry.hash = hash(&ts->key);
+	entry.ts = ts;
+	place_entry(ht, &entry);
+	ht->num += 1;
+	ht->gen += 1;
+
+	if (ht->wheel != NULL) {
+		ts->idle_timer.expire = ht->wheel->next + TIME_TO_WHEEL_TICK(idle_timeout * NSEC_PER_SEC);
+		add_timer(ht->wheel, &ts->idle_timer);
+	}
 
 	return 0;
 }
 
-int delete_ts_entry(struct hash_table_entry **hash_table, struct tcp_state *ts)
+int delete_ts_entry(struct hash_table *ht, struct tcp_state *ts)
 {
-	int hv = hash(&ts->key);
-
-	struct hash_table_entry *entry = hash_table[hv],
-							*temp = NULL;
-	if (memcmp(&entry->ts->key, &ts->key, sizeof(struct tcp_key)) == 0) {
-		temp = entry;
-		hash_table[hv] = temp->next;
-		finish_tcp_state(temp->ts);
-		FREE(temp);
-		return 1;
+	uint32_t hv = hash(&ts->key);
+	uint32_t i = hv & ht->mask, d = 0;
+	while (1) {
+		struct hash_slot *slot = &ht->slots[i];
+		if (slot->hash == 0 || probe_dist(ht, slot->hash, i) < d)
+			return 0;
+		if (slot->hash == hv && key_equal(&slot->key, &ts->key))
+			break;
+
+		i = (i + 1) & ht->mask;
+		d += 1;
 	}
-	else {
-		while (entry->next) {
-			temp = entry->next;
-			if (memcmp(&temp->ts->key, &ts->key, sizeof(struct tcp_key)) == 0) {
-				entry->next = temp->next;
-				finish_tcp_state(temp->ts);
-				FREE(temp);
-				return 1;
-			}
-
-			entry = entry->next;
-		}
 
-		return 0;
+	// shift the following entries back until an empty or home slot
+	uint32_t next = (i + 1) & ht->mask;
+	while (ht->slots[next].hash != 0 && probe_dist(ht, ht->slots[next].hash, next) != 0) {
+		ht->slots[i] = ht->slots[next];
+		i = next;
+		next = (next + 1) & ht->mask;
 	}
+	memset(&ht->slots[i], 0, sizeof(struct hash_slot));
+	ht->num -= 1;
+	ht->gen += 1;
+
+	if (ht->wheel != NULL && timer_pending(&ts->idle_timer))
+		del_timer(ht->wheel, &ts->idle_timer);
+
+	finish_tcp_state(ts);
+	return 1;
 }
 
-void cleanup_hash_table(struct hash_table_entry **hash_table)
+/*
+ * Finish the flows without any packet in the last idle_timeout seconds.
+ * Timers are not moved when a packet arrives; a fired timer is re-armed
+ * from the last packet time if the flow is still active.
+ */
+void expire_ts_entries(struct hash_table *ht, nstime_t now)
 {
-	int i = 0;
-	for (; i < HASH_TABLE_SIZE; i++) {
-		while (hash_table[i] != NULL) {
-			struct hash_table_entry *temp = hash_table[i];
-			hash_table[i] = hash_table[i]->next;
-			finish_tcp_state(temp->ts);
-			FREE(temp);
+	if (ht->wheel == NULL)
+		return;
+
+	struct list_head expired;
+	init_list_head(&expired);
+	advance_timer_wheel(ht->wheel, TIME_TO_WHEEL_TICK(now), &expired);
+
+	while (!list_empty(&expired)) {
+		struct timer *t = list_entry(expired.next, struct timer, list);
+		struct tcp_state *ts = list_entry(t, struct tcp_state, idle_timer);
+		list_delete_entry(&t->list);
+		t->list.next = t->list.prev = NULL;
+
+		uint64_t deadline = TIME_TO_WHEEL_TICK(ts->last_time + idle_timeout * NSEC_PER_SEC);
+		if (deadline >= ht->wheel->next) {
+			t->expire = deadline;
+			add_timer(ht->wheel, t);
+		}
+		else {
+			delete_ts_entry(ht, ts);
 		}
-	} 
+	}
+}
 
-	FREE(hash_table);
+static int cmp_ts_key(const void *a, const void *b)
+{
+	const struct tcp_state *x = *(struct tcp_state * const *)a,
+		  *y = *(struct tcp_state * const *)b;
+	return memcmp(&x->key, &y->key, sizeof(struct tcp_key));
+}
+
+// the flows still open are finished in the order of their keys, as the
+// workers report them, see cmp_report()
+void cleanup_hash_table(struct hash_table *ht)
+{
+	uint32_t i = 0, n = 0;
+	struct tcp_state **open = MALLOC_N(struct tcp_state *, ht->mask+1);
+	for (; i <= ht->mask; i++) {
+		if (ht->slots[i].hash != 0)
+			open[n++] = ht->slots[i].ts;
+	}
+	qsort(open, n, sizeof(struct tcp_state *), cmp_ts_key);
+	for (i = 0; i < n; i++)
+		finish_tcp_state(open[i]);
+	FREE_N(open);
+
+	FREE_N(ht->slots);
+	if (ht->wheel != NULL)
+		FREE_N(ht->wheel);
+	FREE_N(ht);
 }
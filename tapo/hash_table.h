@@ -3,19 +3,43 @@
 
 #include "tcp_base.h"
 #include "tcp_state.h"
+#include "timer_wheel.h"
 
-#define BITS 20
-#define HASH_TABLE_SIZE (1 << BITS)
+/*
+ * Open-addressing flow table with Robin Hood probing. The tcp key and its
+ * hash are stored inline in the slot, so a lookup usually touches only one
+ * cache line. Deletion shifts the following entries backwards, no
+ * tombstones are left behind.
+ */
+#define HASH_TABLE_INIT_BITS 10
+// grow when the table is 7/8 full
+#define HASH_TABLE_LOAD(size) ((size) - ((size) >> 3))
 
-struct hash_table_entry {
+struct hash_slot {
+	struct tcp_key key;
+	uint32_t hash; // 0 for an empty slot
 	struct tcp_state *ts;
-	struct hash_table_entry *next;
 };
 
-struct hash_table_entry **new_hash_table();
-struct tcp_state *find_ts_entry(struct hash_table_entry **hash_table, struct tcp_key *key);
-int insert_ts_entry(struct hash_table_entry **hash_table, struct tcp_state *ts);
-int delete_ts_entry(struct hash_table_entry **hash_table, struct tcp_state *ts);
-void cleanup_hash_table(struct hash_table_entry **hash_table);
+struct hash_table {
+	struct hash_slot *slots;
+	uint32_t mask;
+	uint32_t num;
+	// bumped when a flow is inserted or deleted, a flow found before
+	// is still the one of its key while it is unchanged
+	uint32_t gen;
+
+	// idle flows expire after idle_timeout seconds, NULL if disabled
+	struct timer_wheel *wheel;
+};
+
+struct hash_table *new_hash_table();
+struct tcp_state *find_ts_entry(struct hash_table *hash_table, struct tcp_key *key);
+void prefetch_ts_slot(struct hash_table *hash_table, struct tcp_key *key);
+struct tcp_state *prefetch_ts_entry(struct hash_table *hash_table, struct tcp_key *key);
+int insert_ts_entry(struct hash_table *hash_table, struct tcp_state *ts);
+int delete_ts_entry(struct hash_table *hash_table, struct tcp_state *ts);
+void expire_ts_entries(struct hash_table *hash_table, nstime_t now);
+void cleanup_hash_table(struct hash_table *hash_table);
 
 #endif
@@ -51,8 +51,8 @@ do { \
 	while (p != (list)) { \
 		t = p; \
 		p = p->next; \
-		FREE(list_entry(t, type, member)); \
 		list_delete_entry(t); \
+		FREE(list_entry(t, type, member)); \
 	} \
 } while (0)
 
@@ -6,12 +6,19 @@
 #include "malloc.h"
 #include "log.h"
 #include "cmd_options.h"
+#include "tcp_worker.h"
+#include "output.h"
+#include "series_bin.h"
+#include "server_set.h"
+#include "pcap_index.h"
+#include "rule_engine.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pcap.h>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -19,19 +26,18 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
-struct in_addr server;
 pcap_t *pcap_handle;
-struct hash_table_entry **hash_table;
+struct hash_table *hash_table;
 static int pkt_counter = 0;
+static volatile sig_atomic_t stopping = 0;
 
-void cleanup();
+// the signal caught, the capture is finished in main() after it
 static void handle_signal(int signo)
 {
-	fprintf(stdout, "catch signo %d, finishing...\n", signo);
-	cleanup();
-	fprintf(stdout, "finished.\n");
-
-	exit(0);
+	// the reader loop stops, a live ring sees poll() interrupted
+	stopping = signo;
+	if (pcap_handle != NULL)
+		pcap_breakloop(pcap_handle);
 }
 
 static void register_signal()
@@ -49,97 +55,94 @@ static void register_signal()
 
 void init()
 {
-	pcap_handle = pcap_init();
-
-	if (inet_aton(server_ip, &server) != 1) {
-		LOG(ERROR, "Could not convert server ip to in_addr\n");
+	if ((server_ip[0] != '\0' && add_server(server_ip, server_port) != 0) ||
+			(server_file[0] != '\0' && load_server_file(server_file) != 0) ||
+			build_server_set() != 0)
 		exit(1);
-	}
+	if (load_stall_rules(rules_paths, rules_path_num) != 0)
+		exit(1);
+
+	pcap_handle = pcap_init();
 
 	register_signal();
+	init_output();
+	if (series_path[0] != '\0') {
+		if (open_series_file(series_path) != 0)
+			exit(1);
+		series_out = series_file;
+	}
 
-	hash_table = new_hash_table();
+	if (worker_num > 1 && use_tpacket)
+		init_capture_workers(worker_num);
+	else if (worker_num > 1)
+		init_workers(worker_num);
+	else
+		hash_table = new_hash_table();
 }
 
 void cleanup()
 {
 	pcap_cleanup(pcap_handle);
-	cleanup_hash_table(hash_table);
-}
-
-static void parse_tcp_info(struct tcp_key *key, double time, struct tcphdr *th, int len, int dir)
-{
-	// LOG(INFO, "time: %.6lf, len: %d, dir: %d\n", time, len, dir);
-	struct tcp_state * ts = find_ts_entry(hash_table, key);
-	if (ts == NULL && IS_SYN(th) && dir == DIR_IN) {
-		ts = new_tcp_state(key, time);
-		insert_ts_entry(hash_table, ts);
-	}
-
-	if (ts != NULL) {
-		tcp_state_machine(ts, th, len, time, dir);
-
-		if (ts->state == TCP_CLOSE || ts->state == TCP_CLOSING) {
-			delete_ts_entry(hash_table, ts);
-			// free_tcp_state(ts);
-		}
-		//if (IS_SYN(th) && dir == DIR_IN ) {
-		//	delete_ts_entry(hash_table, ts);
-		//	ts = new_tcp_state(key, time);
-		//	insert_ts_entry(hash_table, ts);
-		//}
-	}
+	if (worker_num > 1)
+		cleanup_workers();
+	else
+		cleanup_hash_table(hash_table);
+	// all the flows are finished
+	if (stall_rule_num > 1)
+		dump_stall_table(&stdout_stream);
+	pool_thread_cleanup();
+	tcp_state_thread_cleanup();
+	close_series_file();
+	cleanup_output();
+	cleanup_server_set();
+	free_stall_rules();
 }
 
 void handle_pcap()
 {
-	struct pcap_pkthdr pph;
-	const u_char *packet;
-	while ((packet = pcap_next(pcap_handle, &pph))) {
-		pkt_counter += 1;
-		if (pcap_limit > 0 && pkt_counter >= pcap_limit) {
-			LOG(INFO, "finished...\n");
-			exit(0);
-		}
+	static struct pkt_vec vec;
 
-		double time = (double)pph.ts.tv_sec + (double)(pph.ts.tv_usec)/1000000;
+	// the workers read their own rings, see capture_main()
+	if (worker_num > 1 && use_tpacket) {
+		while (!stopping && !capture_finished())
+			usleep(100000);
+		return;
+	}
 
-		int len = pph.caplen;
-		struct ip *ip_hdr = get_ip_hdr(packet, &len);
-		if (ip_hdr == NULL)
-			continue;
+	while (!stopping) {
+		int max = PKT_BATCH;
+		if (pcap_limit > 0)
+			max = MIN(max, pcap_limit - pkt_counter);
 
-		struct tcphdr *tcp_hdr = (struct tcphdr *)((u_char *)ip_hdr + ip_hdr->ip_hl*4);
-		int iphdr_len = ip_hdr->ip_hl*4;
-		int tcphdr_len = tcp_hdr->doff*4;
+		int raw = pcap_next_batch(pcap_handle, &vec, max);
+		if (raw == 0)
+			break;
 
-		if (tcphdr_len > len) {
-			LOG(DEBUG, "tcp header is not captured completely.\n"); 
-			continue;
-		}
+		// the packet reaching the limit is not handled
+		int num = vec.num;
+		int limited = (pcap_limit > 0 && pkt_counter + raw >= pcap_limit);
+		if (limited && num > 0 && vec.idx[num-1] == raw-1)
+			num -= 1;
 
-		/* get tcp key */
-		int dir;
-		struct tcp_key key;
-		if (memcmp(&ip_hdr->ip_src, &server, sizeof(server)) == 0) {
-			key.addr[0] = ip_hdr->ip_src;
-			key.addr[1] = ip_hdr->ip_dst;
-			key.port[0] = tcp_hdr->source;
-			key.port[1] = tcp_hdr->dest;
-			dir = DIR_OUT;
+		/* parse tcp info */
+		if (worker_num > 1) {
+			int i = 0;
+			for (; i < num; i++)
+				dispatch_pkt(pkt_counter + vec.idx[i] + 1, &vec.key[i], vec.time[i],
+						(struct tcphdr *)vec.tcp_hdr[i], vec.len[i], vec.dir[i]);
 		}
 		else {
-			key.addr[0] = ip_hdr->ip_dst;
-			key.addr[1] = ip_hdr->ip_src;
-			key.port[0] = tcp_hdr->dest;
-			key.port[1] = tcp_hdr->source;
-			dir = DIR_IN;
+			parse_tcp_batch(hash_table, &vec, num);
 		}
+		pkt_counter += raw;
 
-		int payload_len = ntohs(ip_hdr->ip_len) - iphdr_len - tcphdr_len;
-
-		/* parse tcp info */
-		parse_tcp_info(&key, time, tcp_hdr, payload_len, dir);
+		// the open flows are finished by cleanup(), with or without workers
+		if (limited) {
+			out_flush(&stdout_stream);
+			out_sync();
+			LOG(INFO, "finished...\n");
+			break;
+		}
 	}
 }
 
@@ -147,9 +150,25 @@ int main(int argc, const char **argv)
 {
 	parse_cmd_options(argc, argv);
 
+	if (build_index) {
+		int i = 0;
+		for (; i < pcap_file_num; i++) {
+			if (build_pcap_index(pcap_files[i]) != 0)
+				return 1;
+		}
+		return 0;
+	}
+
 	init();
 	handle_pcap();
+	if (stopping) {
+		out_flush(&stdout_stream);
+		out_sync();
+		fprintf(stdout, "catch signo %d, finishing...\n", stopping);
+	}
 	cleanup();
+	if (stopping)
+		fprintf(stdout, "finished.\n");
 
 	return 0;
 }
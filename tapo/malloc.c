@@ -3,9 +3,6 @@
 #include <assert.h>
 #include <string.h>
 
-// TODO: If deployed in high-end servers, there should be 
-// a memory-pool module.
-
 void *my_malloc(size_t size)
 {
 	void *ptr = malloc(size);
@@ -14,7 +11,137 @@ void *my_malloc(size_t size)
 	return ptr;
 }
 
+void *my_malloc_aligned(size_t align, size_t size)
+{
+	void *ptr = NULL;
+	int ret = posix_memalign(&ptr, align, size);
+	assert(ret == 0);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
 void my_free(void *ptr)
 {
-	free(ptr); 
+	free(ptr);
+}
+
+/*
+ * Slabs of a pool grow from 256 bytes up to 64 KB, so short flows only pay
+ * for a small slab. Released slabs are kept in a per-thread cache indexed
+ * by their order and reused by the next flows.
+ */
+#define SLAB_MIN_SHIFT 8
+#define SLAB_ORDERS 9
+#define SLAB_CACHE_LIMIT 64
+
+struct slab {
+	struct slab *next;
+	int order;
+	// objects follow, aligned to POOL_CLASS_SIZE
+	char data[] __attribute__((aligned(POOL_CLASS_SIZE)));
+};
+
+#define SLAB_SIZE(order) ((size_t)1 << ((order) + SLAB_MIN_SHIFT))
+
+__thread struct mem_pool *cur_pool = NULL;
+
+static __thread struct mem_pool thread_pool;
+static __thread struct slab *slab_cache[SLAB_ORDERS];
+static __thread int slab_cache_num[SLAB_ORDERS];
+
+static struct slab *new_slab(int order)
+{
+	struct slab *slab = slab_cache[order];
+	if (slab != NULL) {
+		slab_cache[order] = slab->next;
+		slab_cache_num[order] -= 1;
+	}
+	else {
+		slab = malloc(SLAB_SIZE(order));
+		assert(slab != NULL);
+		slab->order = order;
+	}
+
+	return slab;
+}
+
+static void *pool_grow(struct mem_pool *pool, size_t size)
+{
+	int order = 0;
+	if (pool->slabs != NULL)
+		order = pool->slabs->order + 1 < SLAB_ORDERS ? pool->slabs->order + 1 : SLAB_ORDERS-1;
+
+	struct slab *slab = new_slab(order);
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->cur = slab->data + size;
+	pool->end = (char *)slab + SLAB_SIZE(order);
+
+	return slab->data;
+}
+
+void *pool_alloc(size_t size)
+{
+	struct mem_pool *pool = cur_pool ? cur_pool : &thread_pool;
+	int c = (size-1) / POOL_CLASS_SIZE;
+	size = (c+1) * POOL_CLASS_SIZE;
+
+	void *ptr = pool->free_list[c];
+	if (ptr != NULL) {
+		pool->free_list[c] = *(void **)ptr;
+	}
+	else if (pool->cur != NULL && pool->cur + size <= pool->end) {
+		ptr = pool->cur;
+		pool->cur += size;
+	}
+	else {
+		ptr = pool_grow(pool, size);
+	}
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void pool_free(void *ptr, size_t size)
+{
+	struct mem_pool *pool = cur_pool ? cur_pool : &thread_pool;
+	int c = (size-1) / POOL_CLASS_SIZE;
+	*(void **)ptr = pool->free_list[c];
+	pool->free_list[c] = ptr;
+}
+
+// release all the objects of the pool at once
+void pool_release(struct mem_pool *pool)
+{
+	struct slab *slab = pool->slabs;
+	while (slab != NULL) {
+		struct slab *next = slab->next;
+		if (slab_cache_num[slab->order] < SLAB_CACHE_LIMIT) {
+			slab->next = slab_cache[slab->order];
+			slab_cache[slab->order] = slab;
+			slab_cache_num[slab->order] += 1;
+		}
+		else {
+			free(slab);
+		}
+		slab = next;
+	}
+
+	memset(pool, 0, sizeof(struct mem_pool));
+}
+
+// free the thread pool and the slab cache before a thread exits
+void pool_thread_cleanup()
+{
+	pool_release(&thread_pool);
+
+	int i = 0;
+	for (; i < SLAB_ORDERS; i++) {
+		while (slab_cache[i] != NULL) {
+			struct slab *slab = slab_cache[i];
+			slab_cache[i] = slab->next;
+			free(slab);
+		}
+		slab_cache_num[i] = 0;
+	}
 }
@@ -2,16 +2,69 @@
 #define __MALLOC_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 
 inline void *my_malloc(size_t s);
 inline void my_free(void *ptr);
+void *my_malloc_aligned(size_t align, size_t size);
+
+/*
+ * Small objects (list nodes, stall records, ...) are allocated from memory
+ * pools with fixed size classes. Every flow owns a pool which is released
+ * as a whole when the flow finishes; objects allocated while no flow pool
+ * is active come from a pool of the calling thread.
+ */
+#define POOL_CLASS_SIZE 16
+#define POOL_CLASSES 8
+#define POOL_MAX_SIZE (POOL_CLASS_SIZE*POOL_CLASSES)
+
+struct slab;
+
+struct mem_pool {
+	void *free_list[POOL_CLASSES];
+	struct slab *slabs;
+	char *cur;
+	char *end;
+};
+
+extern __thread struct mem_pool *cur_pool;
+
+void *pool_alloc(size_t size);
+void pool_free(void *ptr, size_t size);
+void pool_release(struct mem_pool *pool);
+void pool_thread_cleanup();
+
+// set the active pool, return the previous one
+static inline struct mem_pool *use_pool(struct mem_pool *pool)
+{
+	struct mem_pool *prev = cur_pool;
+	cur_pool = pool;
+	return prev;
+}
 
 #define MALLOC_N(type, n) ({ \
-	void *ptr = my_malloc(sizeof(type)*n); \
+	void *ptr = my_malloc(sizeof(type)*(n)); \
 	(type *)(ptr); \
 })
 
-#define MALLOC(type) MALLOC_N(type, 1)
-#define FREE(ptr) my_free(ptr)
+// types aligned beyond malloc(), e.g. to cache lines, bypass the pools
+#define MALLOC(type) ({ \
+	void *ptr = __alignof__(type) > 16 ? \
+		my_malloc_aligned(__alignof__(type), sizeof(type)) : \
+		sizeof(type) <= POOL_MAX_SIZE ? \
+		pool_alloc(sizeof(type)) : my_malloc(sizeof(type)); \
+	(type *)(ptr); \
+})
+
+// FREE takes a typed pointer to an object from MALLOC, FREE_N an array
+#define FREE(obj) do { \
+	typeof(obj) __obj = (obj); \
+	if (__alignof__(*__obj) <= 16 && sizeof(*__obj) <= POOL_MAX_SIZE) \
+		pool_free(__obj, sizeof(*__obj)); \
+	else \
+		my_free(__obj); \
+} while (0)
+
+#define FREE_N(ptr) my_free(ptr)
 
 #endif
@@ -0,0 +1,244 @@
+#include "output.h"
+#include "log.h"
+#include "def.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio_ext.h>
+
+struct out_buf {
+	struct out_buf *next;
+	int fd;
+	size_t len;
+	char data[OUT_BUF_SIZE];
+};
+
+struct out_stream stdout_stream = { .fd = 1 };
+
+static pthread_t writer_tid;
+static int writer_running = 0;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t out_done = PTHREAD_COND_INITIALIZER;
+
+// buffers to write, in FIFO order
+static struct out_buf *queue_head = NULL, *queue_tail = NULL;
+static int queue_num = 0;
+// the writer is writing a buffer taken from the queue
+static int writing = 0;
+static int stopping = 0;
+static struct out_buf *free_bufs = NULL;
+
+static void write_buf(struct out_buf *b)
+{
+	size_t off = 0;
+	while (off < b->len) {
+		ssize_t n = write(b->fd, b->data + off, b->len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOG(ERROR, "write output failed: %s\n", strerror(errno));
+			return;
+		}
+		off += n;
+	}
+}
+
+static void *writer_main(void *arg)
+{
+	pthread_mutex_lock(&out_lock);
+	while (1) {
+		while (queue_num == 0 && !stopping)
+			pthread_cond_wait(&out_ready, &out_lock);
+		if (queue_num == 0)
+			break;
+
+		struct out_buf *b = queue_head;
+		queue_head = b->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+		queue_num -= 1;
+		writing = 1;
+		pthread_mutex_unlock(&out_lock);
+
+		write_buf(b);
+
+		pthread_mutex_lock(&out_lock);
+		writing = 0;
+		b->next = free_bufs;
+		free_bufs = b;
+		pthread_cond_broadcast(&out_done);
+	}
+	pthread_mutex_unlock(&out_lock);
+
+	return NULL;
+}
+
+static struct out_buf *get_buf(int fd)
+{
+	struct out_buf *b;
+	pthread_mutex_lock(&out_lock);
+	while (free_bufs == NULL && queue_num >= OUT_QUEUE_DEPTH)
+		pthread_cond_wait(&out_done, &out_lock);
+	b = free_bufs;
+	if (b != NULL)
+		free_bufs = b->next;
+	pthread_mutex_unlock(&out_lock);
+
+	if (b == NULL && (b = malloc(sizeof(struct out_buf))) == NULL) {
+		LOG(ERROR, "malloc output buffer failed.\n");
+		exit(1);
+	}
+
+	b->next = NULL;
+	b->fd = fd;
+	b->len = 0;
+	return b;
+}
+
+// flush at exit(), e.g. when the packet limit of -c is reached
+static void flush_at_exit()
+{
+	out_flush(&stdout_stream);
+	cleanup_output();
+}
+
+void init_output()
+{
+	if (pthread_create(&writer_tid, NULL, writer_main, NULL) != 0) {
+		LOG(ERROR, "Could not create writer thread\n");
+		exit(1);
+	}
+	writer_running = 1;
+	atexit(flush_at_exit);
+}
+
+void out_stream_init(struct out_stream *s, int fd)
+{
+	s->fd = fd;
+	s->buf = NULL;
+	s->offset = 0;
+}
+
+void out_flush(struct out_stream *s)
+{
+	struct out_buf *b = s->buf;
+	if (b == NULL)
+		return;
+	s->buf = NULL;
+	if (b->len == 0) {
+		pthread_mutex_lock(&out_lock);
+		b->next = free_bufs;
+		free_bufs = b;
+		pthread_mutex_unlock(&out_lock);
+		return;
+	}
+
+	if (!writer_running) {
+		write_buf(b);
+		free(b);
+		return;
+	}
+
+	// the messages printed by stdio before must go first
+	if (s->fd == 1 && __fpending(stdout) > 0) {
+		out_sync();
+		fflush(stdout);
+	}
+
+	pthread_mutex_lock(&out_lock);
+	if (queue_tail != NULL)
+		queue_tail->next = b;
+	else
+		queue_head = b;
+	queue_tail = b;
+	queue_num += 1;
+	pthread_cond_signal(&out_ready);
+	pthread_mutex_unlock(&out_lock);
+}
+
+void out_write(struct out_stream *s, const void *data, size_t len)
+{
+	const char *p = (const char *)data;
+	while (len > 0) {
+		if (s->buf == NULL)
+			s->buf = get_buf(s->fd);
+
+		size_t n = MIN(len, OUT_BUF_SIZE - s->buf->len);
+		memcpy(s->buf->data + s->buf->len, p, n);
+		s->buf->len += n;
+		s->offset += n;
+		p += n;
+		len -= n;
+
+		if (s->buf->len == OUT_BUF_SIZE)
+			out_flush(s);
+	}
+}
+
+void out_printf(struct out_stream *s, const char *fmt, ...)
+{
+	if (s->buf != NULL && OUT_BUF_SIZE - s->buf->len < OUT_RECORD_MAX)
+		out_flush(s);
+	if (s->buf == NULL)
+		s->buf = get_buf(s->fd);
+
+	struct out_buf *b = s->buf;
+	size_t room = OUT_BUF_SIZE - b->len;
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(b->data + b->len, room, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+
+	if (n < room) {
+		b->len += n;
+		s->offset += n;
+		return;
+	}
+
+	// a record too long to be formatted in place
+	char *tmp = malloc(n + 1);
+	if (tmp == NULL) {
+		LOG(ERROR, "malloc output record failed.\n");
+		exit(1);
+	}
+	va_start(ap, fmt);
+	vsnprintf(tmp, n + 1, fmt, ap);
+	va_end(ap);
+	out_write(s, tmp, n);
+	free(tmp);
+}
+
+// wait until all the buffers handed over are written
+void out_sync()
+{
+	pthread_mutex_lock(&out_lock);
+	while (queue_num > 0 || writing)
+		pthread_cond_wait(&out_done, &out_lock);
+	pthread_mutex_unlock(&out_lock);
+}
+
+void cleanup_output()
+{
+	out_flush(&stdout_stream);
+	if (writer_running) {
+		pthread_mutex_lock(&out_lock);
+		stopping = 1;
+		pthread_cond_signal(&out_ready);
+		pthread_mutex_unlock(&out_lock);
+		pthread_join(writer_tid, NULL);
+		writer_running = 0;
+	}
+
+	while (free_bufs != NULL) {
+		struct out_buf *b = free_bufs;
+		free_bufs = b->next;
+		free(b);
+	}
+}
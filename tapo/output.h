@@ -0,0 +1,55 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stddef.h>
+
+/*
+ * Buffered output. Records are formatted into large per-stream buffers,
+ * full buffers are handed to a writer thread which writes them with one
+ * write() each, in the order they were handed over.
+ *
+ * A stream belongs to one thread. The stdout stream is used by the main
+ * thread, the workers of the sharded engine have their own streams.
+ */
+#define OUT_BUF_SIZE (1 << 20)
+// buffers waiting for the writer, the producers block beyond that
+#define OUT_QUEUE_DEPTH 32
+// the largest record formatted in place
+#define OUT_RECORD_MAX 1024
+
+// kinds of output, see -O
+enum {
+	OUT_SERIES = 1,   // per-packet series
+	OUT_SNAPSHOT = 2, // periodic per-flow snapshots
+	OUT_SUMMARY = 4,  // flow reports when flows finish
+};
+
+#define DEFAULT_OUTPUT_KINDS (OUT_SERIES | OUT_SUMMARY)
+// nanoseconds of capture time, 1 second
+#define DEFAULT_SNAPSHOT_INTERVAL 1000000000LL
+
+struct out_buf;
+
+struct out_stream {
+	int fd;
+	struct out_buf *buf;
+	long offset; // bytes put into the stream so far
+};
+
+extern struct out_stream stdout_stream;
+
+void init_output();
+void out_stream_init(struct out_stream *s, int fd);
+void out_printf(struct out_stream *s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void out_write(struct out_stream *s, const void *data, size_t len);
+void out_flush(struct out_stream *s);
+void out_sync();
+void cleanup_output();
+
+static inline long out_tell(struct out_stream *s)
+{
+	return s->offset;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include "pcap_decomp.h"
+#include "malloc.h"
+#include "log.h"
+#include "def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+struct decomp {
+	int type;
+	const char *name;
+	int in_fd; // the compressed file
+	int out_fd; // the write end of the pipe
+	pthread_t tid;
+	struct decomp *next;
+};
+
+static struct decomp *decomps = NULL;
+
+static const char *comp_names[] = { "none", "gzip", "zstd", "lz4" };
+
+int comp_type(const char *path)
+{
+	unsigned char m[4];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return COMP_NONE;
+	ssize_t n = read(fd, m, sizeof(m));
+	close(fd);
+
+	if (n >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+		return COMP_GZIP;
+	if (n == 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd)
+		return COMP_ZSTD;
+	if (n == 4 && m[0] == 0x04 && m[1] == 0x22 && m[2] == 0x4d && m[3] == 0x18)
+		return COMP_LZ4;
+	return COMP_NONE;
+}
+
+// return -1 if the reader is gone or the pipe is broken
+static int write_out(struct decomp *d, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t n = write(d->out_fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (errno != EPIPE)
+				LOG(ERROR, "%s: write pipe failed: %s\n", d->name, strerror(errno));
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+static int read_in(struct decomp *d, void *buf, size_t len)
+{
+	ssize_t n;
+	while ((n = read(d->in_fd, buf, len)) < 0 && errno == EINTR)
+		;
+	if (n < 0)
+		LOG(ERROR, "%s: read failed: %s\n", d->name, strerror(errno));
+	return n;
+}
+#endif
+
+static void gzip_main(struct decomp *d, char *out)
+{
+	// concatenated members are read as one stream by gzread()
+	gzFile gz = gzdopen(dup(d->in_fd), "rb");
+	if (gz == NULL) {
+		LOG(ERROR, "%s: could not open gzip stream\n", d->name);
+		return;
+	}
+	gzbuffer(gz, DECOMP_BUF_SIZE);
+
+	int n;
+	while ((n = gzread(gz, out, DECOMP_BUF_SIZE)) > 0) {
+		if (write_out(d, out, n) != 0)
+			break;
+	}
+	if (n < 0) {
+		int err;
+		LOG(ERROR, "%s: %s\n", d->name, gzerror(gz, &err));
+	}
+	gzclose(gz);
+}
+
+#ifdef HAVE_ZSTD
+static void zstd_main(struct decomp *d, char *out)
+{
+	ZSTD_DStream *ds = ZSTD_createDStream();
+	ZSTD_initDStream(ds);
+	char *in = MALLOC_N(char, DECOMP_BUF_SIZE);
+
+	int n;
+	while ((n = read_in(d, in, DECOMP_BUF_SIZE)) > 0) {
+		ZSTD_inBuffer ib = { in, n, 0 };
+		ZSTD_outBuffer ob = { out, DECOMP_BUF_SIZE, 0 };
+		// a full output may leave data in the decoder
+		while (ib.pos < ib.size || ob.pos == ob.size) {
+			ob.pos = 0;
+			size_t ret = ZSTD_decompressStream(ds, &ob, &ib);
+			if (ZSTD_isError(ret)) {
+				LOG(ERROR, "%s: %s\n", d->name, ZSTD_getErrorName(ret));
+				goto out;
+			}
+			if (write_out(d, out, ob.pos) != 0)
+				goto out;
+		}
+	}
+
+out:
+	FREE_N(in);
+	ZSTD_freeDStream(ds);
+}
+#endif
+
+#ifdef HAVE_LZ4
+static void lz4_main(struct decomp *d, char *out)
+{
+	LZ4F_dctx *dctx;
+	size_t ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+	if (LZ4F_isError(ret)) {
+		LOG(ERROR, "%s: %s\n", d->name, LZ4F_getErrorName(ret));
+		return;
+	}
+	char *in = MALLOC_N(char, DECOMP_BUF_SIZE);
+
+	int n;
+	while ((n = read_in(d, in, DECOMP_BUF_SIZE)) > 0) {
+		size_t pos = 0, out_len = 0;
+		while (pos < n || out_len == DECOMP_BUF_SIZE) {
+			size_t in_len = n - pos;
+			out_len = DECOMP_BUF_SIZE;
+			ret = LZ4F_decompress(dctx, out, &out_len, in + pos, &in_len, NULL);
+			if (LZ4F_isError(ret)) {
+				LOG(ERROR, "%s: %s\n", d->name, LZ4F_getErrorName(ret));
+				goto out;
+			}
+			pos += in_len;
+			if (write_out(d, out, out_len) != 0)
+				goto out;
+		}
+	}
+
+out:
+	FREE_N(in);
+	LZ4F_freeDecompressionContext(dctx);
+}
+#endif
+
+static void *decomp_main(void *arg)
+{
+	struct decomp *d = (struct decomp *)arg;
+	char *out = MALLOC_N(char, DECOMP_BUF_SIZE);
+
+	// a closed reader shows up as EPIPE
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	switch (d->type) {
+		case COMP_GZIP:
+			gzip_main(d, out);
+			break;
+#ifdef HAVE_ZSTD
+		case COMP_ZSTD:
+			zstd_main(d, out);
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case COMP_LZ4:
+			lz4_main(d, out);
+			break;
+#endif
+	}
+
+	// libpcap sees the end of the file
+	close(d->out_fd);
+	close(d->in_fd);
+	FREE_N(out);
+	return NULL;
+}
+
+static int supported(int type)
+{
+	switch (type) {
+		case COMP_GZIP:
+			return 1;
+#ifdef HAVE_ZSTD
+		case COMP_ZSTD:
+			return 1;
+#endif
+#ifdef HAVE_LZ4
+		case COMP_LZ4:
+			return 1;
+#endif
+	}
+	return 0;
+}
+
+pcap_t *pcap_open_file(const char *path, char *errbuf)
+{
+	int type = comp_type(path);
+	if (type == COMP_NONE)
+		return pcap_open_offline_with_tstamp_precision(path,
+				PCAP_TSTAMP_PRECISION_NANO, errbuf);
+
+	if (!supported(type)) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s support is not compiled in",
+				path, comp_names[type]);
+		return NULL;
+	}
+
+	int in_fd = open(path, O_RDONLY);
+	int pfd[2];
+	if (in_fd < 0 || pipe(pfd) != 0) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		if (in_fd >= 0)
+			close(in_fd);
+		return NULL;
+	}
+	// best effort, the default pipe holds 64KB only
+	fcntl(pfd[1], F_SETPIPE_SZ, DECOMP_PIPE_SIZE);
+
+	FILE *fp = fdopen(pfd[0], "rb");
+	pcap_t *handle;
+	struct decomp *d = MALLOC_N(struct decomp, 1);
+	d->type = type;
+	d->name = path;
+	d->in_fd = in_fd;
+	d->out_fd = pfd[1];
+
+	if (pthread_create(&d->tid, NULL, decomp_main, d) != 0) {
+		LOG(ERROR, "Could not create decompression thread of %s\n", path);
+		exit(1);
+	}
+	d->next = decomps;
+	decomps = d;
+
+	// the file header is read here, after the thread is running
+	if ((handle = pcap_fopen_offline_with_tstamp_precision(fp,
+					PCAP_TSTAMP_PRECISION_NANO, errbuf)) == NULL)
+		fclose(fp);
+	return handle;
+}
+
+void decomp_cleanup()
+{
+	while (decomps != NULL) {
+		struct decomp *d = decomps;
+		decomps = d->next;
+		pthread_join(d->tid, NULL);
+		FREE_N(d);
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef __PCAP_DECOMP_H__
+#define __PCAP_DECOMP_H__
+
+#include <pcap.h>
+
+/*
+ * Offline captures compressed by gzip, zstd or lz4 are read without
+ * unpacking them to disk. The format is detected by the magic of the file,
+ * a thread decompresses it into a pipe and libpcap reads the other end.
+ * The pipe bounds the data decompressed ahead of the parser.
+ *
+ * zstd and lz4 need their libraries at build time, see the Makefile.
+ */
+#define DECOMP_PIPE_SIZE (1 << 20)
+#define DECOMP_BUF_SIZE (256 << 10)
+
+enum { COMP_NONE, COMP_GZIP, COMP_ZSTD, COMP_LZ4 };
+
+int comp_type(const char *path);
+// pcap_open_offline() for plain and compressed files, with nanosecond
+// timestamps
+pcap_t *pcap_open_file(const char *path, char *errbuf);
+// called after the handles are closed
+void decomp_cleanup();
+
+#endif
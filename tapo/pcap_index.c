@@ -0,0 +1,409 @@
+#include "pcap_index.h"
+#include "tcp_pcap.h"
+#include "malloc.h"
+#include "log.h"
+#include "def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the index of the file read by a query
+static const u_char *idx_base = NULL;
+static size_t idx_size = 0;
+static const struct index_hdr *idx = NULL;
+static const struct index_time *times = NULL;
+static const uint64_t *flow_start = NULL;
+static const uint64_t *flow_offset = NULL;
+
+static int64_t from_ns = INT64_MIN;
+static int64_t to_ns = INT64_MAX;
+static int has_flow = 0;
+static struct tcp_key flow_key;
+// the entries of the flow bucket left to read
+static uint64_t flow_cur = 0, flow_end = 0;
+static size_t stop_offset = 0;
+
+// the lower endpoint first, both directions get the same key
+static void set_key(struct tcp_key *key, struct in_addr a, uint16_t pa,
+		struct in_addr b, uint16_t pb)
+{
+	if (ntohl(a.s_addr) > ntohl(b.s_addr) ||
+			(a.s_addr == b.s_addr && ntohs(pa) > ntohs(pb))) {
+		swap(a, b);
+		swap(pa, pb);
+	}
+	key->addr[0] = a;
+	key->addr[1] = b;
+	key->port[0] = pa;
+	key->port[1] = pb;
+}
+
+static int pkt_key(const u_char *pkt, int caplen, struct tcp_key *key)
+{
+	int len = caplen;
+	struct ip *ip_hdr = get_ip_hdr(pkt, &len);
+	if (ip_hdr == NULL || ip_hdr->ip_p != IPPROTO_TCP || len < 4)
+		return -1;
+
+	struct tcphdr *th = (struct tcphdr *)((u_char *)ip_hdr + ip_hdr->ip_hl*4);
+	set_key(key, ip_hdr->ip_src, th->source, ip_hdr->ip_dst, th->dest);
+	return 0;
+}
+
+static inline uint32_t flow_bucket(struct tcp_key *key)
+{
+	uint64_t a;
+	uint32_t b;
+	memcpy(&a, key, sizeof(a));
+	memcpy(&b, (char *)key + sizeof(a), sizeof(b));
+
+	uint64_t h = (a ^ ((uint64_t)b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+	return (h >> 32) & (INDEX_FLOW_BUCKETS - 1);
+}
+
+/*
+ * Two passes over the mapped file: the first counts the packets of every
+ * flow bucket and collects the time entries, the second fills the buckets.
+ */
+int build_pcap_index(const char *path)
+{
+	struct mmap_pcap mp;
+	if (mmap_pcap_open(&mp, path) != 0) {
+		LOG(ERROR, "Could not index %s: not a pcap or pcapng file.\n", path);
+		return -1;
+	}
+	if (set_link_type(mp.link_type) != 0) {
+		mmap_pcap_close(&mp);
+		return -1;
+	}
+
+	struct stat st;
+	fstat(mp.fd, &st);
+
+	struct index_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_VERSION;
+	hdr.flow_buckets = INDEX_FLOW_BUCKETS;
+	hdr.file_size = mp.size;
+	hdr.file_mtime = st.st_mtime;
+
+	uint64_t *start = MALLOC_N(uint64_t, INDEX_FLOW_BUCKETS + 1);
+	struct index_time *tv = NULL;
+	int time_cap = 0;
+	size_t begin = mp.pos;
+
+	struct pcap_pkthdr pph;
+	struct tcp_key key;
+	const u_char *pkt;
+	while ((pkt = mmap_pcap_next(&mp, &pph)) != NULL) {
+		if (hdr.time_num == 0)
+			hdr.first_ns = pkt_time(&pph.ts);
+
+		if (hdr.time_num == 0 || pph.ts.tv_sec > tv[hdr.time_num-1].sec) {
+			if (hdr.time_num == time_cap) {
+				time_cap = time_cap ? time_cap*2 : 1024;
+				tv = realloc(tv, time_cap*sizeof(struct index_time));
+				if (tv == NULL) {
+					LOG(ERROR, "realloc index times failed: %s\n", strerror(errno));
+					exit(1);
+				}
+			}
+			tv[hdr.time_num].sec = pph.ts.tv_sec;
+			tv[hdr.time_num].offset = mp.last;
+			hdr.time_num += 1;
+		}
+
+		if (pkt_key(pkt, pph.caplen, &key) == 0) {
+			start[flow_bucket(&key) + 1] += 1;
+			hdr.pkt_num += 1;
+		}
+	}
+
+	int i = 0;
+	for (; i < INDEX_FLOW_BUCKETS; i++)
+		start[i+1] += start[i];
+
+	uint64_t *offset = MALLOC_N(uint64_t, hdr.pkt_num + 1);
+	uint64_t *fill = MALLOC_N(uint64_t, INDEX_FLOW_BUCKETS);
+	memcpy(fill, start, INDEX_FLOW_BUCKETS*sizeof(uint64_t));
+
+	mmap_pcap_close(&mp);
+	mmap_pcap_open(&mp, path);
+	mp.pos = begin;
+	while ((pkt = mmap_pcap_next(&mp, &pph)) != NULL) {
+		if (pkt_key(pkt, pph.caplen, &key) == 0)
+			offset[fill[flow_bucket(&key)]++] = mp.last;
+	}
+	mmap_pcap_close(&mp);
+
+	char ipath[1024], tmp[1040];
+	snprintf(ipath, sizeof(ipath), "%s%s", path, INDEX_SUFFIX);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ipath);
+
+	int ret = 0;
+	FILE *fp = fopen(tmp, "wb");
+	if (fp == NULL ||
+			fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+			fwrite(tv, sizeof(struct index_time), hdr.time_num, fp) != hdr.time_num ||
+			fwrite(start, sizeof(uint64_t), INDEX_FLOW_BUCKETS + 1, fp) != INDEX_FLOW_BUCKETS + 1 ||
+			fwrite(offset, sizeof(uint64_t), hdr.pkt_num, fp) != hdr.pkt_num ||
+			fclose(fp) != 0 ||
+			rename(tmp, ipath) != 0) {
+		LOG(ERROR, "Could not write index %s: %s\n", ipath, strerror(errno));
+		unlink(tmp);
+		ret = -1;
+	}
+	else {
+		LOG(INFO, "%s: %lu tcp packets in %u seconds indexed.\n", ipath,
+				(unsigned long)hdr.pkt_num, hdr.time_num);
+	}
+
+	free(tv);
+	FREE_N(start);
+	FREE_N(offset);
+	FREE_N(fill);
+	return ret;
+}
+
+/*
+ * Seconds since the epoch, or since the first packet with a leading '+'.
+ * The fraction is read digit by digit, a double does not hold nanoseconds
+ * of an epoch time.
+ */
+static int parse_time(const char *arg, int64_t *ns)
+{
+	int64_t base = 0;
+	if (*arg == '+') {
+		base = idx->first_ns;
+		arg++;
+	}
+
+	const char *p = arg;
+	int64_t sec = 0, frac = 0, scale = NSEC_PER_SEC;
+	for (; *p >= '0' && *p <= '9'; p++) {
+		sec = sec*10 + (*p - '0');
+		if (sec > INT64_MAX / NSEC_PER_SEC / 2)
+			return -1;
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++) {
+			if (scale > 1) {
+				scale /= 10;
+				frac += (*p - '0') * scale;
+			}
+		}
+	}
+	if (p == arg || *p != '\0')
+		return -1;
+
+	*ns = base + sec * NSEC_PER_SEC + frac;
+	return 0;
+}
+
+static int parse_endpoint(const char *arg, size_t len, struct in_addr *addr, uint16_t *port)
+{
+	char buf[64];
+	if (len >= sizeof(buf))
+		return -1;
+	memcpy(buf, arg, len);
+	buf[len] = '\0';
+
+	char *colon = strchr(buf, ':');
+	if (colon == NULL)
+		return -1;
+	*colon = '\0';
+
+	int p;
+	if (inet_pton(AF_INET, buf, addr) != 1 || sscanf(colon+1, "%d", &p) != 1 ||
+			p < 0 || p > 65535)
+		return -1;
+	*port = htons(p);
+	return 0;
+}
+
+// "ip:port,ip:port", in either order
+static int parse_flow(const char *arg, struct tcp_key *key)
+{
+	struct in_addr a, b;
+	uint16_t pa, pb;
+	const char *comma = strchr(arg, ',');
+	if (comma == NULL ||
+			parse_endpoint(arg, comma - arg, &a, &pa) != 0 ||
+			parse_endpoint(comma+1, strlen(comma+1), &b, &pb) != 0)
+		return -1;
+
+	set_key(key, a, pa, b, pb);
+	return 0;
+}
+
+static void unmap_index()
+{
+	munmap((void *)idx_base, idx_size);
+	idx_base = NULL;
+	idx = NULL;
+}
+
+static int map_index(struct mmap_pcap *mp, const char *path)
+{
+	char ipath[1024];
+	snprintf(ipath, sizeof(ipath), "%s%s", path, INDEX_SUFFIX);
+
+	struct stat st, cap_st;
+	int fd = open(ipath, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		LOG(ERROR, "Could not open index %s: %s, see --build-index.\n", ipath, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	idx_size = st.st_size;
+	void *addr = (idx_size >= sizeof(struct index_hdr)) ?
+		mmap(NULL, idx_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (addr == MAP_FAILED) {
+		LOG(ERROR, "Could not map index %s.\n", ipath);
+		return -1;
+	}
+	idx_base = (const u_char *)addr;
+	idx = (const struct index_hdr *)addr;
+
+	if (memcmp(idx->magic, INDEX_MAGIC, sizeof(idx->magic)) != 0 ||
+			idx->version != INDEX_VERSION ||
+			idx->flow_buckets != INDEX_FLOW_BUCKETS ||
+			idx_size != sizeof(struct index_hdr) + idx->time_num*sizeof(struct index_time) +
+				(INDEX_FLOW_BUCKETS + 1 + idx->pkt_num)*sizeof(uint64_t)) {
+		LOG(ERROR, "%s is not a valid index.\n", ipath);
+		unmap_index();
+		return -1;
+	}
+
+	fstat(mp->fd, &cap_st);
+	if (idx->file_size != mp->size || idx->file_mtime != cap_st.st_mtime) {
+		LOG(ERROR, "%s is stale, rebuild it with --build-index.\n", ipath);
+		unmap_index();
+		return -1;
+	}
+
+	times = (const struct index_time *)(idx + 1);
+	flow_start = (const uint64_t *)(times + idx->time_num);
+	flow_offset = flow_start + INDEX_FLOW_BUCKETS + 1;
+	return 0;
+}
+
+// the first time entry later than sec
+static uint32_t time_upper_bound(int64_t sec)
+{
+	uint32_t lo = 0, hi = idx->time_num;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo)/2;
+		if (times[mid].sec <= sec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Records are out of time order by less than a second: the packets from
+ * `from' on follow the first record of the second before, and the ones up
+ * to `to' precede the first record two seconds later.
+ */
+int open_pcap_index(struct mmap_pcap *mp, const char *path)
+{
+	if (map_index(mp, path) != 0)
+		return -1;
+
+	if (query_from[0] != '\0' && parse_time(query_from, &from_ns) != 0) {
+		LOG(ERROR, "Invalid time %s, expect seconds since the epoch or +seconds.\n", query_from);
+		return -1;
+	}
+	if (query_to[0] != '\0' && parse_time(query_to, &to_ns) != 0) {
+		LOG(ERROR, "Invalid time %s, expect seconds since the epoch or +seconds.\n", query_to);
+		return -1;
+	}
+	if (query_flow[0] != '\0') {
+		if (parse_flow(query_flow, &flow_key) != 0) {
+			LOG(ERROR, "Invalid flow %s, expect ip:port,ip:port.\n", query_flow);
+			return -1;
+		}
+		has_flow = 1;
+	}
+
+	// pcapng interfaces are described before the first packet
+	struct pcap_pkthdr pph;
+	if (mmap_pcap_next(mp, &pph) == NULL)
+		return 0;
+	size_t start = mp->last;
+
+	if (from_ns != INT64_MIN) {
+		uint32_t i = time_upper_bound(from_ns/NSEC_PER_SEC - 1);
+		if (i > 0)
+			start = MAX(start, times[i-1].offset);
+	}
+
+	stop_offset = mp->size;
+	if (to_ns != INT64_MAX) {
+		uint32_t i = time_upper_bound(to_ns/NSEC_PER_SEC + 1);
+		if (i < idx->time_num)
+			stop_offset = times[i].offset;
+	}
+
+	mp->pos = start;
+	if (has_flow) {
+		uint32_t b = flow_bucket(&flow_key);
+		uint64_t lo = flow_start[b], hi = flow_start[b+1];
+		flow_end = hi;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo)/2;
+			if (flow_offset[mid] < start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		flow_cur = lo;
+	}
+
+	return 0;
+}
+
+const u_char *index_next(struct mmap_pcap *mp, struct pcap_pkthdr *pph)
+{
+	const u_char *pkt;
+	struct tcp_key key;
+
+	while (1) {
+		if (has_flow) {
+			if (flow_cur == flow_end)
+				return NULL;
+			mp->pos = flow_offset[flow_cur++];
+		}
+		if (mp->pos >= stop_offset)
+			return NULL;
+
+		if ((pkt = mmap_pcap_next(mp, pph)) == NULL)
+			return NULL;
+
+		int64_t t = pkt_time(&pph->ts);
+		if (t < from_ns || t > to_ns)
+			continue;
+		// buckets are shared with other flows
+		if (has_flow && (pkt_key(pkt, pph->caplen, &key) != 0 ||
+					memcmp(&key, &flow_key, sizeof(key)) != 0))
+			continue;
+		return pkt;
+	}
+}
+
+void close_pcap_index()
+{
+	if (idx_base != NULL)
+		unmap_index();
+}
@@ -0,0 +1,61 @@
+#ifndef __PCAP_INDEX_H__
+#define __PCAP_INDEX_H__
+
+#include <stdint.h>
+
+#include "pcap_mmap.h"
+#include "cmd_options.h"
+
+/*
+ * Sidecar index of a pcap/pcapng file, see --build-index. It is written
+ * next to the capture as <file>.tidx and lets --from/--to and --flow read
+ * only the records they need instead of scanning the whole file.
+ *
+ * The file starts with a struct index_hdr, followed by
+ *
+ *     struct index_time time[time_num]       by second, ascending
+ *     uint64_t flow_start[flow_buckets + 1]  first entry of every bucket
+ *     uint64_t flow_offset[pkt_num]          records of the tcp packets
+ *
+ * A time entry holds the offset of the first record of a second later than
+ * all the records before it. A flow bucket holds the offsets of the tcp
+ * packets whose endpoints hash into it, in file order; both directions of
+ * a connection share a bucket. The index does not depend on the servers,
+ * and all values are in host byte order.
+ */
+#define INDEX_MAGIC "TAPOIDX1"
+#define INDEX_VERSION 2
+#define INDEX_SUFFIX ".tidx"
+#define INDEX_FLOW_BUCKETS (1 << 16)
+
+struct index_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t flow_buckets;
+	// of the capture, a changed file makes the index stale
+	uint64_t file_size;
+	int64_t file_mtime;
+	int64_t first_ns; // time of the first packet
+	uint64_t pkt_num;
+	uint32_t time_num;
+	uint32_t reserved;
+};
+
+struct index_time {
+	int64_t sec;
+	uint64_t offset;
+};
+
+int build_pcap_index(const char *path);
+
+// whether --from, --to or --flow is given
+static inline int index_query()
+{
+	return query_from[0] != '\0' || query_to[0] != '\0' || query_flow[0] != '\0';
+}
+
+int open_pcap_index(struct mmap_pcap *mp, const char *path);
+const u_char *index_next(struct mmap_pcap *mp, struct pcap_pkthdr *pph);
+void close_pcap_index();
+
+#endif
@@ -0,0 +1,332 @@
+#include "pcap_merge.h"
+#include "pcap_decomp.h"
+#include "malloc.h"
+#include "log.h"
+#include "def.h"
+#include "tcp_base.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static struct pcap_source *sources = NULL;
+static int source_num = 0;
+
+// indexes of the sources with a head packet, the earliest first
+static int *heap = NULL;
+static int heap_num = 0;
+// the source whose head was returned last, advanced at the next call
+static int last = -1;
+
+static inline void ring_push(struct chunk_ring *ring, struct pkt_chunk *chunk)
+{
+	ring->slot[(ring->head + ring->num) % CHUNK_QUEUE_DEPTH] = chunk;
+	ring->num += 1;
+}
+
+static inline struct pkt_chunk *ring_pop(struct chunk_ring *ring)
+{
+	struct pkt_chunk *chunk = ring->slot[ring->head];
+	ring->head = (ring->head + 1) % CHUNK_QUEUE_DEPTH;
+	ring->num -= 1;
+	return chunk;
+}
+
+int merge_open(char **files, int num, int *link_type, uint32_t *snaplen)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	sources = MALLOC_N(struct pcap_source, num);
+	heap = MALLOC_N(int, num);
+	source_num = num;
+
+	int i = 0;
+	for (; i < num; i++) {
+		struct pcap_source *src = &sources[i];
+		int lt;
+		uint32_t sl;
+		src->id = i;
+		src->name = files[i];
+		if (mmap_pcap_open(&src->mfile, files[i]) == 0) {
+			src->use_mmap = 1;
+			lt = src->mfile.link_type;
+			sl = src->mfile.snaplen;
+		}
+		else if ((src->handle = pcap_open_file(files[i], errbuf)) != NULL) {
+			lt = pcap_datalink(src->handle);
+			sl = pcap_snapshot(src->handle);
+		}
+		else {
+			LOG(ERROR, "Could not open pcap file %s: %s\n", files[i], errbuf);
+			return -1;
+		}
+
+		// get_ip_hdr() expects one link type
+		if (i == 0) {
+			*link_type = lt;
+			*snaplen = sl;
+		}
+		else if (lt != *link_type) {
+			LOG(ERROR, "%s: link type %d differs from %d of %s.\n",
+					files[i], lt, *link_type, files[0]);
+			return -1;
+		}
+		*snaplen = MAX(*snaplen, sl);
+	}
+
+	return 0;
+}
+
+static struct pkt_chunk *new_chunk(struct pcap_source *src)
+{
+	struct pkt_chunk *chunk = MALLOC_N(struct pkt_chunk, 1);
+	if (!src->use_mmap)
+		chunk->buf = MALLOC_N(u_char, CHUNK_BUF_SIZE);
+	return chunk;
+}
+
+// fill a chunk, return 1 at the end of the file
+static int fill_chunk(struct pcap_source *src, struct pkt_chunk *chunk)
+{
+	chunk->num = 0;
+	chunk->pos = 0;
+	chunk->used = 0;
+
+	while (chunk->num < CHUNK_PKTS) {
+		struct pcap_pkthdr *pph = &chunk->hdr[chunk->num];
+		const u_char *pkt;
+
+		if (src->use_mmap) {
+			// the pages of the packet are faulted in here, not by the merge
+			if ((pkt = mmap_pcap_next(&src->mfile, pph)) == NULL)
+				return 1;
+			if (!pcap_offline_filter(src->fp, pph, pkt))
+				continue;
+			chunk->data[chunk->num++] = pkt;
+			continue;
+		}
+
+		// a packet of snaplen bytes must fit
+		if (chunk->used + src->snaplen > CHUNK_BUF_SIZE)
+			return 0;
+
+		struct pcap_pkthdr *h;
+		int ret = pcap_next_ex(src->handle, &h, &pkt);
+		if (ret == -1)
+			LOG(ERROR, "%s: %s\n", src->name, pcap_geterr(src->handle));
+		if (ret < 0)
+			return 1;
+		if (ret == 0 || h->caplen > src->snaplen)
+			continue;
+
+		*pph = *h;
+		memcpy(chunk->buf + chunk->used, pkt, h->caplen);
+		chunk->data[chunk->num++] = chunk->buf + chunk->used;
+		chunk->used += h->caplen;
+	}
+
+	return 0;
+}
+
+static void *source_main(void *arg)
+{
+	struct pcap_source *src = (struct pcap_source *)arg;
+	int eof = 0;
+
+	while (!eof) {
+		pthread_mutex_lock(&src->lock);
+		while (src->free.num == 0 && !src->stop)
+			pthread_cond_wait(&src->not_full, &src->lock);
+		if (src->stop) {
+			pthread_mutex_unlock(&src->lock);
+			break;
+		}
+		struct pkt_chunk *chunk = ring_pop(&src->free);
+		pthread_mutex_unlock(&src->lock);
+
+		eof = fill_chunk(src, chunk);
+
+		pthread_mutex_lock(&src->lock);
+		ring_push(&src->full, chunk);
+		src->eof = eof;
+		pthread_cond_signal(&src->not_empty);
+		pthread_mutex_unlock(&src->lock);
+	}
+
+	return NULL;
+}
+
+// the earlier packet, then the earlier file
+static inline int head_before(int a, int b)
+{
+	struct pkt_chunk *ca = sources[a].cur, *cb = sources[b].cur;
+	struct timeval *ta = &ca->hdr[ca->pos].ts, *tb = &cb->hdr[cb->pos].ts;
+	if (ta->tv_sec != tb->tv_sec)
+		return ta->tv_sec < tb->tv_sec;
+	if (ta->tv_usec != tb->tv_usec)
+		return ta->tv_usec < tb->tv_usec;
+	return a < b;
+}
+
+static void sift_down(int i)
+{
+	while (1) {
+		int l = 2*i + 1, r = l + 1, m = i;
+		if (l < heap_num && head_before(heap[l], heap[m]))
+			m = l;
+		if (r < heap_num && head_before(heap[r], heap[m]))
+			m = r;
+		if (m == i)
+			return;
+		swap(heap[i], heap[m]);
+		i = m;
+	}
+}
+
+static void sift_up(int i)
+{
+	while (i > 0 && head_before(heap[i], heap[(i-1)/2])) {
+		swap(heap[i], heap[(i-1)/2]);
+		i = (i-1)/2;
+	}
+}
+
+/*
+ * Move the source to its next packet, waiting for the read-ahead if
+ * needed. Return 0 if the file is finished.
+ */
+static int advance_source(struct pcap_source *src)
+{
+	if (src->cur != NULL && ++src->cur->pos < src->cur->num)
+		return 1;
+
+	pthread_mutex_lock(&src->lock);
+	while (1) {
+		if (src->cur != NULL) {
+			ring_push(&src->free, src->cur);
+			src->cur = NULL;
+			pthread_cond_signal(&src->not_full);
+		}
+		while (src->full.num == 0 && !src->eof)
+			pthread_cond_wait(&src->not_empty, &src->lock);
+		if (src->full.num == 0)
+			break;
+
+		src->cur = ring_pop(&src->full);
+		if (src->cur->num > 0)
+			break;
+	}
+	pthread_mutex_unlock(&src->lock);
+
+	return src->cur != NULL;
+}
+
+int merge_start(struct bpf_program *fp, struct bpf_program *mmap_fp)
+{
+	int i = 0, j = 0;
+	for (; i < source_num; i++) {
+		struct pcap_source *src = &sources[i];
+		src->fp = fp;
+		if (src->use_mmap) {
+			src->fp = mmap_fp;
+			src->snaplen = 0;
+		}
+		else {
+			src->snaplen = pcap_snapshot(src->handle);
+			if (src->snaplen <= 0 || src->snaplen > CHUNK_BUF_SIZE)
+				src->snaplen = CHUNK_BUF_SIZE;
+			if (pcap_setfilter(src->handle, fp) == -1) {
+				LOG(ERROR, "%s: Could not apply filter: %s.\n", src->name, pcap_geterr(src->handle));
+				return -1;
+			}
+		}
+
+		pthread_mutex_init(&src->lock, NULL);
+		pthread_cond_init(&src->not_empty, NULL);
+		pthread_cond_init(&src->not_full, NULL);
+		for (j = 0; j < CHUNK_QUEUE_DEPTH; j++)
+			ring_push(&src->free, new_chunk(src));
+
+		if (pthread_create(&src->tid, NULL, source_main, src) != 0) {
+			LOG(ERROR, "Could not create reader thread of %s\n", src->name);
+			exit(1);
+		}
+	}
+
+	heap_num = 0;
+	for (i = 0; i < source_num; i++) {
+		if (advance_source(&sources[i])) {
+			heap[heap_num] = i;
+			sift_up(heap_num++);
+		}
+	}
+	last = -1;
+
+	return 0;
+}
+
+const u_char *merge_next(struct pcap_pkthdr *pph)
+{
+	if (last >= 0) {
+		// the packet returned last is not used any more
+		if (advance_source(&sources[last])) {
+			sift_down(0);
+		}
+		else {
+			heap[0] = heap[--heap_num];
+			sift_down(0);
+		}
+		last = -1;
+	}
+
+	if (heap_num == 0)
+		return NULL;
+
+	last = heap[0];
+	struct pkt_chunk *chunk = sources[last].cur;
+	*pph = chunk->hdr[chunk->pos];
+	return chunk->data[chunk->pos];
+}
+
+static void free_chunk(struct pkt_chunk *chunk)
+{
+	if (chunk->buf != NULL)
+		FREE_N(chunk->buf);
+	FREE_N(chunk);
+}
+
+void merge_close()
+{
+	int i = 0;
+	for (; i < source_num; i++) {
+		struct pcap_source *src = &sources[i];
+		if (src->tid != 0) {
+			pthread_mutex_lock(&src->lock);
+			src->stop = 1;
+			pthread_cond_signal(&src->not_full);
+			pthread_mutex_unlock(&src->lock);
+			pthread_join(src->tid, NULL);
+
+			if (src->cur != NULL)
+				free_chunk(src->cur);
+			while (src->full.num > 0)
+				free_chunk(ring_pop(&src->full));
+			while (src->free.num > 0)
+				free_chunk(ring_pop(&src->free));
+			pthread_mutex_destroy(&src->lock);
+			pthread_cond_destroy(&src->not_empty);
+			pthread_cond_destroy(&src->not_full);
+		}
+
+		if (src->use_mmap)
+			mmap_pcap_close(&src->mfile);
+		if (src->handle != NULL)
+			pcap_close(src->handle);
+	}
+
+	FREE_N(sources);
+	FREE_N(heap);
+	sources = NULL;
+	heap = NULL;
+	source_num = heap_num = 0;
+	last = -1;
+}
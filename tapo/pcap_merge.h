@@ -0,0 +1,67 @@
+#ifndef __PCAP_MERGE_H__
+#define __PCAP_MERGE_H__
+
+#include <pcap.h>
+#include <pthread.h>
+
+#include "pcap_mmap.h"
+
+/*
+ * Reads several offline captures as one, in timestamp order. Every file
+ * is read ahead by a thread of its own into chunks of packets, and the
+ * heads of the files are merged through a binary heap. Packets of the
+ * same timestamp are taken in the order of the files.
+ *
+ * The chunks of a mapped file point into the mapping, the ones of a file
+ * read by libpcap hold copies of the packets. A packet returned by
+ * merge_next() stays valid until the next call.
+ */
+#define CHUNK_PKTS 1024
+#define CHUNK_BUF_SIZE (1 << 20)
+#define CHUNK_QUEUE_DEPTH 4
+
+struct pkt_chunk {
+	int num;
+	int pos; // the next packet to take
+	struct pcap_pkthdr hdr[CHUNK_PKTS];
+	const u_char *data[CHUNK_PKTS];
+	size_t used;
+	u_char *buf; // NULL for mapped files
+};
+
+struct chunk_ring {
+	struct pkt_chunk *slot[CHUNK_QUEUE_DEPTH];
+	int head;
+	int num;
+};
+
+struct pcap_source {
+	int id;
+	const char *name;
+
+	struct mmap_pcap mfile;
+	int use_mmap;
+	pcap_t *handle;
+	int snaplen; // 0 for mapped files
+	struct bpf_program *fp; // the filter of a mapped file or of the handle
+
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct chunk_ring full;
+	struct chunk_ring free;
+	int eof;
+	int stop;
+
+	// the chunk being read by the merge
+	struct pkt_chunk *cur;
+};
+
+int merge_open(char **files, int num, int *link_type, uint32_t *snaplen);
+// handles filter by fp, mapped files by mmap_fp
+int merge_start(struct bpf_program *fp, struct bpf_program *mmap_fp);
+const u_char *merge_next(struct pcap_pkthdr *pph);
+void merge_close();
+
+#endif
@@ -0,0 +1,320 @@
+#include "pcap_mmap.h"
+#include "log.h"
+#include "def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAP_FILE_HDR_LEN   24
+#define PCAP_PKT_HDR_LEN    16
+
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_PB           0x00000002 /* obsolete packet block */
+#define PCAPNG_SPB          0x00000003
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BYTE_ORDER   0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL  9
+
+static inline uint16_t rd16(struct mmap_pcap *mp, const u_char *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return mp->swapped ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t rd32(struct mmap_pcap *mp, const u_char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return mp->swapped ? __builtin_bswap32(v) : v;
+}
+
+static int pcapng_check_shb(struct mmap_pcap *mp, size_t pos)
+{
+	if (pos + 16 > mp->size)
+		return -1;
+
+	uint32_t order;
+	memcpy(&order, mp->base+pos+8, sizeof(order));
+	if (order == PCAPNG_BYTE_ORDER)
+		mp->swapped = 0;
+	else if (order == __builtin_bswap32(PCAPNG_BYTE_ORDER))
+		mp->swapped = 1;
+	else
+		return -1;
+
+	mp->iface_num = 0;
+	return 0;
+}
+
+static void pcapng_add_iface(struct mmap_pcap *mp, const u_char *body, uint32_t body_len)
+{
+	if (mp->iface_num == MAX_PCAPNG_IFACES) {
+		LOG(WARN, "too many pcapng interfaces, ignored.\n");
+		return;
+	}
+	if (body_len < 8)
+		return;
+
+	int i = mp->iface_num++;
+	mp->iface_link_type[i] = rd16(mp, body);
+	mp->iface_snaplen[i] = rd32(mp, body+4);
+	mp->iface_tsres[i] = 1000000;
+
+	// options
+	uint32_t off = 8;
+	while (off + 4 <= body_len) {
+		uint16_t code = rd16(mp, body+off),
+				 len = rd16(mp, body+off+2);
+		if (code == 0 || off + 4 + len > body_len)
+			break;
+
+		if (code == PCAPNG_OPT_TSRESOL && len >= 1) {
+			uint8_t res = body[off+4];
+			int n = res & 0x7f;
+			if (res & 0x80) {
+				mp->iface_tsres[i] = n < 64 ? ((uint64_t)1 << n) : 1000000;
+			}
+			else {
+				uint64_t ups = 1;
+				while (n-- > 0 && ups <= UINT64_MAX/10)
+					ups *= 10;
+				mp->iface_tsres[i] = ups;
+			}
+		}
+
+		off += 4 + ((len + 3) & ~3);
+	}
+}
+
+static int open_pcapng(struct mmap_pcap *mp)
+{
+	if (pcapng_check_shb(mp, 0) != 0)
+		return -1;
+
+	mp->format = FORMAT_PCAPNG;
+	mp->link_type = -1;
+
+	// peek at the first interface to get the link type
+	size_t pos = 0;
+	while (pos + 12 <= mp->size) {
+		uint32_t type = rd32(mp, mp->base+pos),
+				 len = rd32(mp, mp->base+pos+4);
+		if (len < 12 || pos + len > mp->size)
+			break;
+		if (type == PCAPNG_IDB && len >= 20) {
+			mp->link_type = rd16(mp, mp->base+pos+8);
+			mp->snaplen = rd32(mp, mp->base+pos+12);
+			break;
+		}
+		pos += len;
+	}
+
+	if (mp->link_type < 0) {
+		LOG(ERROR, "no interface description block found in pcapng file.\n");
+		return -1;
+	}
+
+	// packets are read from the beginning, the first SHB is parsed again
+	mp->pos = 0;
+	return 0;
+}
+
+static int open_pcap(struct mmap_pcap *mp, uint32_t magic)
+{
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)
+		mp->swapped = 0;
+	else if (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+		mp->swapped = 1;
+	else
+		return -1;
+
+	if (mp->size < PCAP_FILE_HDR_LEN)
+		return -1;
+
+	mp->format = FORMAT_PCAP;
+	mp->nano = (rd32(mp, mp->base) == PCAP_MAGIC_NSEC);
+	mp->snaplen = rd32(mp, mp->base+16);
+	mp->link_type = rd32(mp, mp->base+20) & 0x0fffffff;
+	mp->pos = PCAP_FILE_HDR_LEN;
+	return 0;
+}
+
+int mmap_pcap_open(struct mmap_pcap *mp, const char *filename)
+{
+	memset(mp, 0, sizeof(struct mmap_pcap));
+	mp->fd = open(filename, O_RDONLY);
+	if (mp->fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(mp->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 4) {
+		close(mp->fd);
+		return -1;
+	}
+
+	mp->size = st.st_size;
+	void *addr = mmap(NULL, mp->size, PROT_READ, MAP_PRIVATE, mp->fd, 0);
+	if (addr == MAP_FAILED) {
+		LOG(DEBUG, "mmap %s failed: %s\n", filename, strerror(errno));
+		close(mp->fd);
+		return -1;
+	}
+	mp->base = (const u_char *)addr;
+	// read ahead of the parser only, the pages behind it may be dropped
+	madvise(addr, mp->size, MADV_SEQUENTIAL);
+
+	uint32_t magic;
+	memcpy(&magic, mp->base, sizeof(magic));
+	int ret = (magic == PCAPNG_SHB) ? open_pcapng(mp) : open_pcap(mp, magic);
+	if (ret != 0)
+		mmap_pcap_close(mp);
+
+	return ret;
+}
+
+static const u_char *next_pcap(struct mmap_pcap *mp, struct pcap_pkthdr *pph)
+{
+	if (mp->pos + PCAP_PKT_HDR_LEN > mp->size)
+		return NULL;
+
+	const u_char *hdr = mp->base + mp->pos;
+	uint32_t caplen = rd32(mp, hdr+8);
+	if (mp->pos + PCAP_PKT_HDR_LEN + caplen > mp->size) {
+		LOG(WARN, "truncated packet at the end of pcap file.\n");
+		mp->pos = mp->size;
+		return NULL;
+	}
+
+	// nanoseconds in tv_usec, see tcp_base.h
+	pph->ts.tv_sec = rd32(mp, hdr);
+	pph->ts.tv_usec = rd32(mp, hdr+4);
+	if (!mp->nano)
+		pph->ts.tv_usec *= 1000;
+	pph->caplen = caplen;
+	pph->len = rd32(mp, hdr+12);
+
+	mp->last = mp->pos;
+	mp->pos += PCAP_PKT_HDR_LEN + caplen;
+	return hdr + PCAP_PKT_HDR_LEN;
+}
+
+static void set_pcapng_ts(struct mmap_pcap *mp, struct pcap_pkthdr *pph,
+		int iface, uint32_t high, uint32_t low)
+{
+	uint64_t ts = ((uint64_t)high << 32) | low;
+	uint64_t ups = mp->iface_tsres[iface];
+	uint64_t frac = ts % ups;
+
+	pph->ts.tv_sec = ts / ups;
+	if (ups == 1000000000)
+		pph->ts.tv_usec = frac;
+	else if (1000000000 % ups == 0)
+		pph->ts.tv_usec = frac * (1000000000 / ups);
+	else if (ups % 1000000000 == 0)
+		pph->ts.tv_usec = frac / (ups / 1000000000);
+	else
+		pph->ts.tv_usec = (uint64_t)((double)frac * 1000000000 / ups);
+}
+
+static const u_char *next_pcapng(struct mmap_pcap *mp, struct pcap_pkthdr *pph)
+{
+	while (mp->pos + 12 <= mp->size) {
+		const u_char *blk = mp->base + mp->pos;
+		uint32_t type, len;
+		memcpy(&type, blk, sizeof(type));
+		if (type == PCAPNG_SHB && pcapng_check_shb(mp, mp->pos) != 0) {
+			LOG(ERROR, "invalid pcapng section header.\n");
+			break;
+		}
+
+		type = rd32(mp, blk);
+		len = rd32(mp, blk+4);
+		if (len < 12 || (len & 3) != 0 || mp->pos + len > mp->size) {
+			LOG(WARN, "truncated or invalid pcapng block.\n");
+			break;
+		}
+		mp->pos += len;
+
+		const u_char *body = blk + 8;
+		uint32_t body_len = len - 12;
+		int iface = 0;
+		uint32_t caplen = 0;
+		const u_char *data = NULL;
+
+		switch (type) {
+			case PCAPNG_IDB:
+				pcapng_add_iface(mp, body, body_len);
+				continue;
+
+			case PCAPNG_EPB:
+			case PCAPNG_PB:
+				if (body_len < 20)
+					continue;
+				iface = (type == PCAPNG_EPB) ? rd32(mp, body) : rd16(mp, body);
+				if (iface >= mp->iface_num)
+					continue;
+				caplen = rd32(mp, body+12);
+				pph->len = rd32(mp, body+16);
+				data = body + 20;
+				if (caplen > body_len - 20)
+					continue;
+				set_pcapng_ts(mp, pph, iface, rd32(mp, body+4), rd32(mp, body+8));
+				break;
+
+			case PCAPNG_SPB:
+				if (body_len < 4 || mp->iface_num == 0)
+					continue;
+				pph->len = rd32(mp, body);
+				caplen = MIN(pph->len, body_len - 4);
+				if (mp->iface_snaplen[0] != 0)
+					caplen = MIN(caplen, mp->iface_snaplen[0]);
+				data = body + 4;
+				// simple packet blocks carry no timestamp
+				pph->ts.tv_sec = 0;
+				pph->ts.tv_usec = 0;
+				break;
+
+			default:
+				continue;
+		}
+
+		if (mp->iface_link_type[iface] != mp->link_type) {
+			LOG(DEBUG, "skip packet with link type %d.\n", mp->iface_link_type[iface]);
+			continue;
+		}
+
+		pph->caplen = caplen;
+		mp->last = blk - mp->base;
+		return data;
+	}
+
+	mp->pos = mp->size;
+	return NULL;
+}
+
+const u_char *mmap_pcap_next(struct mmap_pcap *mp, struct pcap_pkthdr *pph)
+{
+	if (mp->format == FORMAT_PCAP)
+		return next_pcap(mp, pph);
+	else
+		return next_pcapng(mp, pph);
+}
+
+void mmap_pcap_close(struct mmap_pcap *mp)
+{
+	if (mp->base != NULL)
+		munmap((void *)mp->base, mp->size);
+	if (mp->fd >= 0)
+		close(mp->fd);
+	mp->base = NULL;
+	mp->fd = -1;
+}
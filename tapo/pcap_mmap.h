@@ -0,0 +1,44 @@
+#ifndef __PCAP_MMAP_H__
+#define __PCAP_MMAP_H__
+
+#include <pcap.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_PCAPNG_IFACES 64
+
+enum { FORMAT_PCAP = 1, FORMAT_PCAPNG };
+
+/*
+ * Zero-copy reader for offline pcap/pcapng files. The file is mapped into
+ * memory and the packets returned by mmap_pcap_next() point into the
+ * mapping, so they stay valid until mmap_pcap_close().
+ */
+struct mmap_pcap {
+	int fd;
+	const u_char *base;
+	size_t size;
+	size_t pos;
+	// offset of the record of the last packet returned
+	size_t last;
+
+	int format;
+	int swapped;
+	int link_type;
+	uint32_t snaplen;
+
+	// pcap: nanosecond timestamps
+	int nano;
+
+	// pcapng: interfaces of the current section
+	int iface_num;
+	int iface_link_type[MAX_PCAPNG_IFACES];
+	uint32_t iface_snaplen[MAX_PCAPNG_IFACES];
+	uint64_t iface_tsres[MAX_PCAPNG_IFACES]; // units per second
+};
+
+int mmap_pcap_open(struct mmap_pcap *mp, const char *filename);
+const u_char *mmap_pcap_next(struct mmap_pcap *mp, struct pcap_pkthdr *pph);
+void mmap_pcap_close(struct mmap_pcap *mp);
+
+#endif
@@ -0,0 +1,208 @@
+#include "pcap_tpacket.h"
+#include "log.h"
+#include "def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+// only the interfaces with ethernet headers, get_ip_hdr() depends on it
+int tpacket_supported(const char *intf)
+{
+	struct ifreq ifr;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, intf, sizeof(ifr.ifr_name)-1);
+	int ret = ioctl(fd, SIOCGIFHWADDR, &ifr);
+	close(fd);
+	if (ret != 0)
+		return 0;
+
+	return ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER ||
+		ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK;
+}
+
+/*
+ * A fanout_id < 0 opens a socket of its own. The socket is bound to the
+ * interface only after the ring and the filter are set up, so nothing
+ * unfiltered gets into the ring.
+ */
+int tpacket_open(struct tpacket_ring *ring, const char *intf, struct bpf_program *fp, int fanout_id)
+{
+	memset(ring, 0, sizeof(struct tpacket_ring));
+	ring->fd = -1;
+
+	int ifindex = if_nametoindex(intf);
+	if (ifindex == 0) {
+		LOG(ERROR, "Unknown interface %s.\n", intf);
+		return -1;
+	}
+
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, intf, sizeof(ifr.ifr_name)-1);
+
+	ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (ring->fd < 0) {
+		LOG(ERROR, "Could not create packet socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) != 0) {
+		LOG(ERROR, "Could not get the type of %s: %s\n", intf, strerror(errno));
+		goto fail;
+	}
+	ring->loopback = ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK;
+
+	int version = TPACKET_V3;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+		LOG(ERROR, "Could not set TPACKET_V3: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TPACKET_BLOCK_SIZE;
+	req.tp_block_nr = TPACKET_BLOCK_NUM;
+	req.tp_frame_size = TPACKET_FRAME_SIZE;
+	req.tp_frame_nr = TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE * TPACKET_BLOCK_NUM;
+	req.tp_retire_blk_tov = TPACKET_BLOCK_TIMEOUT;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+		LOG(ERROR, "Could not set up rx ring: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	ring->block_num = req.tp_block_nr;
+	ring->block_size = req.tp_block_size;
+	ring->map_len = (size_t)ring->block_num * ring->block_size;
+	void *addr = mmap(NULL, ring->map_len, PROT_READ|PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (addr == MAP_FAILED) {
+		LOG(ERROR, "Could not map rx ring: %s\n", strerror(errno));
+		ring->map = NULL;
+		goto fail;
+	}
+	ring->map = (u_char *)addr;
+
+	// struct bpf_insn has the layout of struct sock_filter
+	struct sock_fprog prog;
+	prog.len = fp->bf_len;
+	prog.filter = (struct sock_filter *)fp->bf_insns;
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+		LOG(ERROR, "Could not attach filter: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) != 0) {
+		LOG(ERROR, "Could not bind to %s: %s\n", intf, strerror(errno));
+		goto fail;
+	}
+
+	if (fanout_id >= 0) {
+		int arg = (fanout_id & 0xffff) |
+			((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) != 0) {
+			LOG(ERROR, "Could not join fanout group %d: %s\n", fanout_id, strerror(errno));
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	tpacket_close(ring);
+	return -1;
+}
+
+static inline struct tpacket_block_desc *ring_block(struct tpacket_ring *ring, unsigned int i)
+{
+	return (struct tpacket_block_desc *)(ring->map + (size_t)i * ring->block_size);
+}
+
+/*
+ * Return the next packet, or NULL if nothing arrives within timeout ms
+ * (-1 waits forever) or poll() is interrupted.
+ */
+const u_char *tpacket_next(struct tpacket_ring *ring, struct pcap_pkthdr *pph, int timeout)
+{
+	while (1) {
+		if (ring->block == NULL) {
+			struct tpacket_block_desc *b = ring_block(ring, ring->cur_block);
+			if (!(__atomic_load_n(&b->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+				struct pollfd pfd;
+				pfd.fd = ring->fd;
+				pfd.events = POLLIN | POLLERR;
+				pfd.revents = 0;
+				int ret = poll(&pfd, 1, timeout);
+				if (ret < 0 && errno != EINTR)
+					LOG(ERROR, "poll on packet socket failed: %s\n", strerror(errno));
+				if (ret <= 0)
+					return NULL;
+				continue;
+			}
+
+			ring->block = b;
+			ring->pkt = (struct tpacket3_hdr *)((u_char *)b + b->hdr.bh1.offset_to_first_pkt);
+			ring->pkt_left = b->hdr.bh1.num_pkts;
+		}
+
+		// give the block back to the kernel when all its packets are read
+		if (ring->pkt_left == 0) {
+			__atomic_store_n(&ring->block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+			ring->block = NULL;
+			ring->cur_block = (ring->cur_block + 1) % ring->block_num;
+			continue;
+		}
+
+		struct tpacket3_hdr *h = ring->pkt;
+		ring->pkt_left -= 1;
+		if (ring->pkt_left > 0)
+			ring->pkt = (struct tpacket3_hdr *)((u_char *)h + h->tp_next_offset);
+
+		// nanoseconds in tv_usec, see tcp_base.h
+		pph->ts.tv_sec = h->tp_sec;
+		pph->ts.tv_usec = h->tp_nsec;
+		pph->caplen = h->tp_snaplen;
+		pph->len = h->tp_len;
+		if ((int64_t)h->tp_sec * 1000000000 + h->tp_nsec < ring->since)
+			continue;
+
+		// keep the incoming copy only, as libpcap does
+		if (ring->loopback) {
+			struct sockaddr_ll *sll = (struct sockaddr_ll *)((u_char *)h +
+					TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			if (sll->sll_pkttype == PACKET_OUTGOING)
+				continue;
+		}
+
+		return (const u_char *)h + h->tp_mac;
+	}
+}
+
+void tpacket_close(struct tpacket_ring *ring)
+{
+	if (ring->map != NULL)
+		munmap(ring->map, ring->map_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ring->map = NULL;
+	ring->block = NULL;
+	ring->fd = -1;
+}
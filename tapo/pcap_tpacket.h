@@ -0,0 +1,50 @@
+#ifndef __PCAP_TPACKET_H__
+#define __PCAP_TPACKET_H__
+
+#include <pcap.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <linux/if_packet.h>
+
+/*
+ * Live capture through an AF_PACKET socket with a TPACKET_V3 ring. The
+ * kernel fills whole blocks of the ring, which are mapped into user space
+ * and handed back only when all their packets are read, so a packet
+ * returned by tpacket_next() stays valid until the next call.
+ *
+ * Sockets opened with the same fanout id share the traffic of the
+ * interface by PACKET_FANOUT_HASH. The hash is symmetric, so both
+ * directions of a flow go to the same socket.
+ */
+#define TPACKET_BLOCK_SIZE (1 << 20)
+#define TPACKET_BLOCK_NUM 64
+#define TPACKET_FRAME_SIZE 2048
+// ms, a block partly filled is retired to user space after that
+#define TPACKET_BLOCK_TIMEOUT 100
+
+struct tpacket_ring {
+	int fd;
+	u_char *map;
+	size_t map_len;
+	unsigned int block_num;
+	unsigned int block_size;
+	// a loopback interface sees every packet twice
+	int loopback;
+
+	// the block being read, NULL if we wait for the kernel
+	unsigned int cur_block;
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *pkt;
+	unsigned int pkt_left;
+
+	// packets captured before are dropped, see init_capture_workers()
+	int64_t since; // ns
+};
+
+int tpacket_supported(const char *intf);
+int tpacket_open(struct tpacket_ring *ring, const char *intf, struct bpf_program *fp, int fanout_id);
+const u_char *tpacket_next(struct tpacket_ring *ring, struct pcap_pkthdr *pph, int timeout);
+void tpacket_close(struct tpacket_ring *ring);
+
+#endif
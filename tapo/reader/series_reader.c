@@ -0,0 +1,134 @@
+#include "series_bin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * Print the binary series written by tcp_tool -w as text, one packet per
+ * line, or list the flows with -l.
+ */
+
+// see DIR_IN and DIR_OUT in tcp_base.h
+static const char *dir_text[] = { "-", "in", "out" };
+
+static const char *usage =
+	"Usage:\n"
+	"    series_reader [ -l ] [ -f flow_id ] series_file\n";
+
+static int read_full(FILE *fp, void *buf, size_t len)
+{
+	return fread(buf, 1, len, fp) == len ? 0 : -1;
+}
+
+static void print_flows(struct series_flow *flows, int rows)
+{
+	int i = 0;
+	char server[INET_ADDRSTRLEN], client[INET_ADDRSTRLEN];
+	for (; i < rows; i++) {
+		struct series_flow *f = &flows[i];
+		inet_ntop(AF_INET, &f->server_addr, server, sizeof(server));
+		inet_ntop(AF_INET, &f->client_addr, client, sizeof(client));
+		printf("flow %u %s.%hu %s.%hu\n", f->flow_id,
+				server, ntohs(f->server_port), client, ntohs(f->client_port));
+	}
+}
+
+static void print_pkts(const char *body, int rows, long flow)
+{
+	const int64_t *time_ns = (const int64_t *)body;
+	const uint32_t *flow_id = (const uint32_t *)(time_ns + rows);
+	const uint32_t *seq = flow_id + rows;
+	const int32_t *inflight = (const int32_t *)(seq + rows);
+	const int32_t *rwnd = inflight + rows;
+	const uint8_t *dir = (const uint8_t *)(rwnd + rows);
+
+	int i = 0;
+	for (; i < rows; i++) {
+		if (flow >= 0 && flow_id[i] != flow)
+			continue;
+		printf("%u %lld.%06lld %u %d %d %s\n", flow_id[i],
+				(long long)(time_ns[i] / 1000000000), (long long)(time_ns[i] % 1000000000 / 1000),
+				seq[i], inflight[i], rwnd[i], dir[i] <= 2 ? dir_text[dir[i]] : "?");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int list_flows = 0;
+	long flow = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "hlf:")) != -1) {
+		switch (opt) {
+			case 'l':
+				list_flows = 1;
+				break;
+			case 'f':
+				if (sscanf(optarg, "%ld", &flow) != 1 || flow < 0) {
+					fprintf(stderr, "%s", usage);
+					return 1;
+				}
+				break;
+			case 'h':
+			default:
+				fprintf(stderr, "%s", usage);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	FILE *fp = fopen(argv[optind], "rb");
+	if (fp == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	struct series_file_hdr fhdr;
+	if (read_full(fp, &fhdr, sizeof(fhdr)) != 0 ||
+			memcmp(fhdr.magic, SERIES_MAGIC, sizeof(fhdr.magic)) != 0 ||
+			fhdr.version != SERIES_VERSION) {
+		fprintf(stderr, "%s: not a series file of version %d\n", argv[optind], SERIES_VERSION);
+		fclose(fp);
+		return 1;
+	}
+
+	if (!list_flows)
+		printf("# flow time seq inflight rwnd dir\n");
+
+	struct series_block_hdr hdr;
+	char *body = NULL;
+	size_t cap = 0;
+	int ret = 0;
+	while (read_full(fp, &hdr, sizeof(hdr)) == 0) {
+		if (hdr.size > cap) {
+			cap = hdr.size;
+			body = realloc(body, cap);
+			if (body == NULL) {
+				fprintf(stderr, "out of memory\n");
+				ret = 1;
+				break;
+			}
+		}
+		if (read_full(fp, body, hdr.size) != 0) {
+			fprintf(stderr, "truncated block\n");
+			ret = 1;
+			break;
+		}
+
+		if (hdr.type == SERIES_BLOCK_FLOWS && list_flows &&
+				hdr.size >= hdr.rows * sizeof(struct series_flow))
+			print_flows((struct series_flow *)body, hdr.rows);
+		else if (hdr.type == SERIES_BLOCK_PKTS && !list_flows &&
+				hdr.size >= SERIES_PKT_BODY_SIZE(hdr.rows))
+			print_pkts(body, hdr.rows, flow);
+	}
+
+	free(body);
+	fclose(fp);
+	return ret;
+}
@@ -0,0 +1,756 @@
+#include "rule_engine.h"
+#include "malloc.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+
+struct rule_set *stall_rules[MAX_RULE_FILES];
+int stall_rule_num = 0;
+
+enum {
+	OP_CONST, OP_FIELD,
+	OP_TO_UINT, OP_TO_DOUBLE, OP_TRUTH, // of the operand a
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+	OP_LT, OP_LE, OP_EQ, OP_NE,
+	OP_AND, OP_OR,
+};
+
+static const struct {
+	const char *name;
+	int offset;
+	int type;
+} fields[] = {
+#define INT_FIELD(f) { #f, offsetof(struct tcp_stall_state, f), RV_INT }
+#define UINT_FIELD(f) { #f, offsetof(struct tcp_stall_state, f), RV_UINT }
+#define DOUBLE_FIELD(f) { #f, offsetof(struct tcp_stall_state, f), RV_DOUBLE }
+	INT_FIELD(init_rwnd),
+	INT_FIELD(max_snd_seg_size),
+	INT_FIELD(rwnd),
+	INT_FIELD(ca_state),
+	DOUBLE_FIELD(duration),
+	DOUBLE_FIELD(srtt),
+	DOUBLE_FIELD(rto),
+	UINT_FIELD(snd_una),
+	UINT_FIELD(snd_nxt),
+	INT_FIELD(packets_out),
+	INT_FIELD(sacked_out),
+	INT_FIELD(holes),
+	INT_FIELD(outstanding),
+	INT_FIELD(lost),
+	INT_FIELD(spurious),
+	INT_FIELD(flow_size),
+	INT_FIELD(tail),
+	INT_FIELD(head),
+	INT_FIELD(cur_pkt_dir),
+	INT_FIELD(cur_pkt_len),
+	UINT_FIELD(cur_pkt_seq),
+	INT_FIELD(last_pkt_dir),
+	INT_FIELD(cur_pkt_spurious_num),
+	INT_FIELD(cur_pkt_lost_num),
+#undef INT_FIELD
+#undef UINT_FIELD
+#undef DOUBLE_FIELD
+};
+
+#define FIELD_NUM (int)(sizeof(fields)/sizeof(fields[0]))
+
+/*
+ * The compiler
+ */
+
+enum { TK_EOF, TK_IDENT, TK_INT, TK_DOUBLE, TK_STRING, TK_OP };
+
+struct parser {
+	const char *path;
+	const char *p; // the rest of the file
+	int line;
+	// the current token
+	int tk;
+	char text[256];
+	int64_t ival;
+	double dval;
+	struct rule_set *rs;
+};
+
+static int parse_error(struct parser *ps, const char *msg)
+{
+	if (ps->tk == TK_EOF)
+		LOG(ERROR, "%s:%d: %s at the end of the file\n", ps->path, ps->line, msg);
+	else
+		LOG(ERROR, "%s:%d: %s near '%s'\n", ps->path, ps->line, msg, ps->text);
+	return -1;
+}
+
+static int next_token(struct parser *ps)
+{
+	const char *p = ps->p;
+	for (;;) {
+		if (*p == '\n')
+			ps->line += 1;
+		if (isspace((unsigned char)*p))
+			p++;
+		else if (*p == '#')
+			while (*p != '\0' && *p != '\n')
+				p++;
+		else
+			break;
+	}
+
+	const char *begin = p;
+	int len;
+	ps->text[0] = '\0';
+	if (*p == '\0') {
+		ps->tk = TK_EOF;
+	}
+	else if (isalpha((unsigned char)*p) || *p == '_') {
+		while (isalnum((unsigned char)*p) || *p == '_')
+			p++;
+		ps->tk = TK_IDENT;
+	}
+	else if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1]))) {
+		char *end;
+		errno = 0;
+		ps->ival = strtoll(p, &end, 10);
+		if (*end == '.' || *end == 'e' || *end == 'E') {
+			ps->dval = strtod(p, &end);
+			ps->tk = TK_DOUBLE;
+		}
+		else {
+			// a literal beyond int would be a long in C
+			if (errno != 0 || ps->ival > INT32_MAX) {
+				ps->p = end;
+				snprintf(ps->text, sizeof(ps->text), "%.*s", (int)(end - begin), begin);
+				return parse_error(ps, "integer out of range");
+			}
+			ps->tk = TK_INT;
+		}
+		p = end;
+	}
+	else if (*p == '"') {
+		// the text is the unescaped string
+		int n = 0;
+		for (p++; *p != '"'; p++) {
+			if (*p == '\0' || *p == '\n') {
+				ps->text[n] = '\0';
+				ps->p = p;
+				return parse_error(ps, "unterminated string");
+			}
+			if (*p == '\\' && p[1] != '\0' && p[1] != '\n')
+				p++;
+			if (n < sizeof(ps->text) - 1)
+				ps->text[n++] = *p;
+		}
+		ps->text[n] = '\0';
+		ps->p = p + 1;
+		ps->tk = TK_STRING;
+		return 0;
+	}
+	else {
+		static const char *ops[] = { "&&", "||", "<=", ">=", "==", "!=",
+			"<", ">", "+", "-", "*", "/", "%", "(", ")" };
+		int i;
+		for (i = 0; i < sizeof(ops)/sizeof(ops[0]); i++) {
+			if (strncmp(p, ops[i], strlen(ops[i])) == 0)
+				break;
+		}
+		if (i == sizeof(ops)/sizeof(ops[0])) {
+			snprintf(ps->text, sizeof(ps->text), "%c", *p);
+			ps->p = p + 1;
+			return parse_error(ps, "unexpected character");
+		}
+		p += strlen(ops[i]);
+		ps->tk = TK_OP;
+	}
+
+	len = p - begin;
+	if (len > sizeof(ps->text) - 1)
+		len = sizeof(ps->text) - 1;
+	memcpy(ps->text, begin, len);
+	ps->text[len] = '\0';
+	ps->p = p;
+	return 0;
+}
+
+static int is_op(struct parser *ps, const char *op)
+{
+	return ps->tk == TK_OP && strcmp(ps->text, op) == 0;
+}
+
+static int is_keyword(struct parser *ps, const char *kw)
+{
+	return ps->tk == TK_IDENT && strcmp(ps->text, kw) == 0;
+}
+
+// the slot of the instruction, a slot of an equal one if any
+static int emit(struct parser *ps, int op, int type, int a, int b, union rule_value imm)
+{
+	struct rule_set *rs = ps->rs;
+	int i;
+
+	switch (op) {
+		case OP_ADD: case OP_MUL: case OP_EQ: case OP_NE: case OP_AND: case OP_OR:
+			// commutative, ordered operands find more equal instructions
+			if (a > b) {
+				int t = a;
+				a = b;
+				b = t;
+			}
+			break;
+	}
+
+	for (i = 0; i < rs->insn_num; i++) {
+		struct rule_insn *in = &rs->insns[i];
+		if (in->op == op && in->type == type && in->a == a && in->b == b &&
+				in->imm.i == imm.i)
+			return i;
+	}
+
+	if (rs->insn_num == RULE_MAX_SLOTS) {
+		LOG(ERROR, "%s:%d: more than %d distinct subexpressions\n",
+				ps->path, ps->line, RULE_MAX_SLOTS);
+		return -1;
+	}
+	struct rule_insn *in = &rs->insns[rs->insn_num];
+	in->op = op;
+	in->type = type;
+	in->a = a;
+	in->b = b;
+	in->imm = imm;
+	return rs->insn_num++;
+}
+
+static int emit_const(struct parser *ps, int type, union rule_value v)
+{
+	return emit(ps, OP_CONST, type, 0, 0, v);
+}
+
+static int convert(struct parser *ps, int slot, int type)
+{
+	struct rule_insn *in = &ps->rs->insns[slot];
+	if (in->type == type)
+		return slot;
+
+	// constants are converted here
+	if (in->op == OP_CONST) {
+		union rule_value v = in->imm;
+		if (type == RV_DOUBLE)
+			v.d = in->type == RV_INT ? (double)(int32_t)v.i : (double)(uint32_t)v.i;
+		else
+			v.i = (uint32_t)v.i;
+		return emit_const(ps, type, v);
+	}
+
+	union rule_value from = { .i = in->type };
+	return emit(ps, type == RV_DOUBLE ? OP_TO_DOUBLE : OP_TO_UINT, type, slot, 0, from);
+}
+
+// the usual arithmetic conversions of C
+static int binary(struct parser *ps, int op, int a, int b)
+{
+	if (a < 0 || b < 0)
+		return -1;
+
+	int ta = ps->rs->insns[a].type, tb = ps->rs->insns[b].type;
+	int type = ta > tb ? ta : tb;
+	if (op == OP_MOD && type == RV_DOUBLE)
+		return parse_error(ps, "'%' of a double");
+	if ((a = convert(ps, a, type)) < 0 || (b = convert(ps, b, type)) < 0)
+		return -1;
+
+	// comparisons are ints, and compare in the type of the operands
+	union rule_value t = { .i = type };
+	if (op >= OP_LT)
+		return emit(ps, op, RV_INT, a, b, t);
+	return emit(ps, op, type, a, b, t);
+}
+
+// an operand of && or ||, 0 or 1
+static int truth(struct parser *ps, int slot)
+{
+	if (slot < 0)
+		return -1;
+
+	struct rule_insn *in = &ps->rs->insns[slot];
+	if (in->op >= OP_LT || in->op == OP_TRUTH)
+		return slot;
+	union rule_value t = { .i = in->type };
+	return emit(ps, OP_TRUTH, RV_INT, slot, 0, t);
+}
+
+static int parse_or(struct parser *ps);
+
+static int parse_primary(struct parser *ps)
+{
+	union rule_value v;
+	int slot, i;
+
+	switch (ps->tk) {
+		case TK_INT:
+			v.i = ps->ival;
+			if (next_token(ps) < 0)
+				return -1;
+			return emit_const(ps, RV_INT, v);
+		case TK_DOUBLE:
+			v.d = ps->dval;
+			if (next_token(ps) < 0)
+				return -1;
+			return emit_const(ps, RV_DOUBLE, v);
+		case TK_IDENT:
+			for (i = 0; i < FIELD_NUM; i++) {
+				if (strcmp(fields[i].name, ps->text) == 0)
+					break;
+			}
+			if (i == FIELD_NUM)
+				return parse_error(ps, "unknown field");
+			v.i = fields[i].offset;
+			if (next_token(ps) < 0)
+				return -1;
+			return emit(ps, OP_FIELD, fields[i].type, 0, 0, v);
+		case TK_OP:
+			if (is_op(ps, "(")) {
+				if (next_token(ps) < 0 || (slot = parse_or(ps)) < 0)
+					return -1;
+				if (!is_op(ps, ")"))
+					return parse_error(ps, "expected ')'");
+				if (next_token(ps) < 0)
+					return -1;
+				return slot;
+			}
+			if (is_op(ps, "-")) {
+				if (next_token(ps) < 0 || (slot = parse_primary(ps)) < 0)
+					return -1;
+				v.i = 0;
+				return binary(ps, OP_SUB, emit_const(ps, RV_INT, v), slot);
+			}
+			break;
+	}
+
+	return parse_error(ps, "expected a field, a number or '('");
+}
+
+static int parse_term(struct parser *ps)
+{
+	int slot = parse_primary(ps);
+	while (slot >= 0) {
+		int op;
+		if (is_op(ps, "*"))
+			op = OP_MUL;
+		else if (is_op(ps, "/"))
+			op = OP_DIV;
+		else if (is_op(ps, "%"))
+			op = OP_MOD;
+		else
+			break;
+		if (next_token(ps) < 0)
+			return -1;
+		slot = binary(ps, op, slot, parse_primary(ps));
+	}
+	return slot;
+}
+
+static int parse_sum(struct parser *ps)
+{
+	int slot = parse_term(ps);
+	while (slot >= 0) {
+		int op;
+		if (is_op(ps, "+"))
+			op = OP_ADD;
+		else if (is_op(ps, "-"))
+			op = OP_SUB;
+		else
+			break;
+		if (next_token(ps) < 0)
+			return -1;
+		slot = binary(ps, op, slot, parse_term(ps));
+	}
+	return slot;
+}
+
+static int parse_cmp(struct parser *ps)
+{
+	int slot = parse_sum(ps);
+	if (slot < 0 || ps->tk != TK_OP)
+		return slot;
+
+	// a > b is b < a, and so on
+	int op, swap = 0;
+	if (is_op(ps, "<"))
+		op = OP_LT;
+	else if (is_op(ps, ">"))
+		op = OP_LT, swap = 1;
+	else if (is_op(ps, "<="))
+		op = OP_LE;
+	else if (is_op(ps, ">="))
+		op = OP_LE, swap = 1;
+	else if (is_op(ps, "=="))
+		op = OP_EQ;
+	else if (is_op(ps, "!="))
+		op = OP_NE;
+	else
+		return slot;
+	if (next_token(ps) < 0)
+		return -1;
+
+	int other = parse_sum(ps);
+	return swap ? binary(ps, op, other, slot) : binary(ps, op, slot, other);
+}
+
+static int parse_and(struct parser *ps)
+{
+	int slot = parse_cmp(ps);
+	while (slot >= 0 && is_op(ps, "&&")) {
+		if (next_token(ps) < 0)
+			return -1;
+		slot = binary(ps, OP_AND, truth(ps, slot), truth(ps, parse_cmp(ps)));
+	}
+	return slot;
+}
+
+static int parse_or(struct parser *ps)
+{
+	int slot = parse_and(ps);
+	while (slot >= 0 && is_op(ps, "||")) {
+		if (next_token(ps) < 0)
+			return -1;
+		slot = binary(ps, OP_OR, truth(ps, slot), truth(ps, parse_and(ps)));
+	}
+	return slot;
+}
+
+static char *copy_string(const char *s)
+{
+	char *str = MALLOC_N(char, strlen(s) + 1);
+	strcpy(str, s);
+	return str;
+}
+
+static int parse_rule(struct parser *ps)
+{
+	struct rule_set *rs = ps->rs;
+	int slot;
+
+	if (!is_keyword(ps, "condition"))
+		return parse_error(ps, "expected 'condition'");
+	if (rs->rule_num == RULE_MAX_RULES)
+		return parse_error(ps, "too many rules");
+	if (next_token(ps) < 0 || (slot = truth(ps, parse_or(ps))) < 0)
+		return -1;
+
+	if (!is_keyword(ps, "type"))
+		return parse_error(ps, "expected 'type'");
+	if (next_token(ps) < 0)
+		return -1;
+	if (ps->tk != TK_IDENT)
+		return parse_error(ps, "expected the name of the type");
+	rs->type[rs->rule_num] = copy_string(ps->text);
+
+	if (next_token(ps) < 0)
+		return -1;
+	if (!is_keyword(ps, "detail"))
+		return parse_error(ps, "expected 'detail'");
+	if (next_token(ps) < 0)
+		return -1;
+	if (ps->tk != TK_STRING)
+		return parse_error(ps, "expected a string");
+	rs->detail[rs->rule_num] = copy_string(ps->text);
+
+	rs->cond[rs->rule_num++] = slot;
+	return next_token(ps);
+}
+
+static char *read_file(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		LOG(ERROR, "Could not open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	size_t len = 0, cap = 4096, n;
+	char *buf = MALLOC_N(char, cap);
+	while ((n = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+		len += n;
+		if (cap - len == 1) {
+			char *bigger = MALLOC_N(char, cap*2);
+			memcpy(bigger, buf, len);
+			FREE_N(buf);
+			buf = bigger;
+			cap *= 2;
+		}
+	}
+	buf[len] = '\0';
+	fclose(fp);
+	return buf;
+}
+
+struct rule_set *load_rules(const char *path)
+{
+	char *text = read_file(path);
+	if (text == NULL)
+		return NULL;
+
+	struct rule_set *rs = MALLOC_N(struct rule_set, 1);
+	memset(rs, 0, sizeof(*rs));
+	rs->path = copy_string(path);
+
+	struct parser ps = { .path = path, .p = text, .line = 1, .rs = rs };
+	int ret = next_token(&ps);
+	while (ret == 0 && ps.tk != TK_EOF)
+		ret = parse_rule(&ps);
+	FREE_N(text);
+
+	if (ret != 0) {
+		free_rules(rs);
+		return NULL;
+	}
+	rs->type[rs->rule_num] = copy_string("UNKNOWN_ISSUE");
+	rs->detail[rs->rule_num] = copy_string("unknown issue");
+	return rs;
+}
+
+void free_rules(struct rule_set *rs)
+{
+	int i;
+	for (i = 0; i <= rs->rule_num; i++) {
+		if (rs->type[i] != NULL)
+			FREE_N(rs->type[i]);
+		if (rs->detail[i] != NULL)
+			FREE_N(rs->detail[i]);
+	}
+	if (rs->table != NULL)
+		FREE_N(rs->table);
+	FREE_N(rs->path);
+	FREE_N(rs);
+}
+
+int load_stall_rules(const char **paths, int num)
+{
+	int i;
+	for (i = 0; i < num; i++) {
+		if ((stall_rules[i] = load_rules(paths[i])) == NULL)
+			return -1;
+		stall_rule_num += 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		struct rule_set *rs = stall_rules[i];
+		int cells = (stall_rules[0]->rule_num + 1) * (rs->rule_num + 1);
+		rs->table = MALLOC_N(uint64_t, cells);
+		memset(rs->table, 0, cells*sizeof(uint64_t));
+	}
+	return 0;
+}
+
+void free_stall_rules()
+{
+	while (stall_rule_num > 0)
+		free_rules(stall_rules[--stall_rule_num]);
+}
+
+void count_stall_types(int (*types)[RULE_BLOCK], int n)
+{
+	int i, j;
+	// the workers count into the same tables
+	for (j = 0; j < stall_rule_num; j++) {
+		struct rule_set *rs = stall_rules[j];
+		for (i = 0; i < n; i++)
+			__sync_fetch_and_add(&rs->table[types[0][i]*(rs->rule_num + 1) + types[j][i]], 1);
+	}
+}
+
+void dump_stall_table(struct out_stream *out)
+{
+	struct rule_set *first = stall_rules[0];
+	int i, j, t;
+
+	// the first set alone, the table of its types with themselves
+	uint64_t total = 0;
+	for (t = 0; t <= first->rule_num; t++)
+		total += first->table[t*(first->rule_num + 1) + t];
+	out_printf(out, "stall types of %s: %llu stalls\n", first->path, (unsigned long long)total);
+	for (t = 0; t <= first->rule_num; t++) {
+		uint64_t cnt = first->table[t*(first->rule_num + 1) + t];
+		if (cnt != 0)
+			out_printf(out, "    %s %llu\n", first->type[t], (unsigned long long)cnt);
+	}
+
+	for (j = 1; j < stall_rule_num; j++) {
+		struct rule_set *rs = stall_rules[j];
+		out_printf(out, "stall types of %s against %s:\n", rs->path, first->path);
+		for (i = 0; i <= first->rule_num; i++) {
+			for (t = 0; t <= rs->rule_num; t++) {
+				uint64_t cnt = rs->table[i*(rs->rule_num + 1) + t];
+				if (cnt != 0)
+					out_printf(out, "    %s %s %llu\n", first->type[i], rs->type[t],
+							(unsigned long long)cnt);
+			}
+		}
+	}
+}
+
+/*
+ * The evaluation, RULE_BLOCK stalls at a time. A slot holds a column of
+ * the values of the stalls of a block as a few vectors, and instructions
+ * are vector operations over them. The ints and uints are 32 bits, so
+ * that an int vector fits one SSE2 or AVX2 register and wraps as in C;
+ * 64 bit lanes would have no compare before SSE4.2.
+ */
+
+typedef int32_t lane_i __attribute__((vector_size(RULE_LANES*4)));
+typedef uint32_t lane_u __attribute__((vector_size(RULE_LANES*4)));
+typedef double lane_d __attribute__((vector_size(RULE_LANES*8)));
+
+union lane_value {
+	lane_i i; // an int or the bits of an uint
+	lane_d d;
+};
+
+#define BLOCK_VECS (RULE_BLOCK/RULE_LANES)
+#define FOR_VECS for (k = 0; k < BLOCK_VECS; k++)
+
+// the double compares give 64 bit masks
+#define MASK(x) __builtin_convertvector(x, lane_i)
+
+// a comparison gives -1 or 0 per lane, the slots hold 1 or 0
+#define ARITH(op) \
+	if (in->type == RV_DOUBLE) \
+		FOR_VECS r[k].d = a[k].d op b[k].d; \
+	else \
+		FOR_VECS r[k].i = (lane_i)((lane_u)a[k].i op (lane_u)b[k].i)
+#define COMPARE(op) \
+	if (in->imm.i == RV_DOUBLE) \
+		FOR_VECS r[k].i = -MASK(a[k].d op b[k].d); \
+	else if (in->imm.i == RV_UINT) \
+		FOR_VECS r[k].i = -((lane_u)a[k].i op (lane_u)b[k].i); \
+	else \
+		FOR_VECS r[k].i = -(a[k].i op b[k].i)
+
+static void eval_block(const struct rule_set *rs, struct tcp_stall_state **tss, int n, int *types)
+{
+	// one more, a rule file may have no rules
+	union lane_value v[rs->insn_num + 1][BLOCK_VECS];
+	const char *base[RULE_BLOCK];
+	lane_i zero, one;
+	int i, k, l;
+
+	// the last stall pads a block
+	for (l = 0; l < RULE_BLOCK; l++)
+		base[l] = (const char *)tss[l < n ? l : n - 1];
+
+	// operands come before their uses
+	for (i = 0; i < rs->insn_num; i++) {
+		const struct rule_insn *in = &rs->insns[i];
+		const union lane_value *a = v[in->a], *b = v[in->b];
+		union lane_value *r = v[i];
+		switch (in->op) {
+			case OP_CONST:
+				if (in->type == RV_DOUBLE)
+					FOR_VECS r[k].d = (lane_d){ 0 } + in->imm.d;
+				else
+					FOR_VECS r[k].i = (lane_i){ 0 } + (int32_t)in->imm.i;
+				break;
+			case OP_FIELD:
+				// the columns are filled here
+				if (in->type == RV_DOUBLE) {
+					for (l = 0; l < RULE_BLOCK; l++)
+						((double *)&r[l / RULE_LANES].d)[l % RULE_LANES] =
+							*(const double *)(base[l] + in->imm.i);
+				}
+				else {
+					for (l = 0; l < RULE_BLOCK; l++)
+						((int32_t *)&r[l / RULE_LANES].i)[l % RULE_LANES] =
+							*(const int32_t *)(base[l] + in->imm.i);
+				}
+				break;
+			case OP_TO_UINT:
+				FOR_VECS r[k] = a[k];
+				break;
+			case OP_TO_DOUBLE:
+				if (in->imm.i == RV_UINT)
+					FOR_VECS r[k].d = __builtin_convertvector((lane_u)a[k].i, lane_d);
+				else
+					FOR_VECS r[k].d = __builtin_convertvector(a[k].i, lane_d);
+				break;
+			case OP_TRUTH:
+				if (in->imm.i == RV_DOUBLE)
+					FOR_VECS r[k].i = -MASK(a[k].d != 0);
+				else
+					FOR_VECS r[k].i = -(a[k].i != 0);
+				break;
+			case OP_ADD:
+				ARITH(+);
+				break;
+			case OP_SUB:
+				ARITH(-);
+				break;
+			case OP_MUL:
+				ARITH(*);
+				break;
+			case OP_DIV:
+			case OP_MOD:
+				if (in->type == RV_DOUBLE) {
+					FOR_VECS r[k].d = a[k].d / b[k].d;
+					break;
+				}
+				// a division by 0 gives 0, INT_MIN / -1 wraps
+				FOR_VECS {
+					zero = b[k].i == 0;
+					one = zero;
+					if (in->type == RV_INT)
+						one |= (a[k].i == INT32_MIN) & (b[k].i == -1);
+					lane_i d = (b[k].i & ~one) | (1 & one);
+					if (in->type == RV_UINT)
+						r[k].i = (lane_i)(in->op == OP_DIV ?
+								(lane_u)a[k].i / (lane_u)d : (lane_u)a[k].i % (lane_u)d);
+					else
+						r[k].i = in->op == OP_DIV ? a[k].i / d : a[k].i % d;
+					r[k].i &= ~zero;
+				}
+				break;
+			case OP_LT:
+				COMPARE(<);
+				break;
+			case OP_LE:
+				COMPARE(<=);
+				break;
+			case OP_EQ:
+				COMPARE(==);
+				break;
+			case OP_NE:
+				COMPARE(!=);
+				break;
+			case OP_AND:
+				FOR_VECS r[k].i = a[k].i & b[k].i;
+				break;
+			case OP_OR:
+				FOR_VECS r[k].i = a[k].i | b[k].i;
+				break;
+			default:
+				FOR_VECS r[k].i = (lane_i){ 0 };
+				break;
+		}
+	}
+
+	// the first matching rule, by the rules from the last one
+	FOR_VECS {
+		lane_i type = (lane_i){ 0 } + rs->rule_num;
+		for (i = rs->rule_num - 1; i >= 0; i--) {
+			lane_i match = -v[rs->cond[i]][k].i;
+			type = (type & ~match) | (i & match);
+		}
+		for (l = 0; l < RULE_LANES && k*RULE_LANES + l < n; l++)
+			types[k*RULE_LANES + l] = type[l];
+	}
+}
+
+void classify_stalls(const struct rule_set *rs, struct tcp_stall_state **tss, int n, int *types)
+{
+	int i;
+	for (i = 0; i < n; i += RULE_BLOCK)
+		eval_block(rs, tss + i, n - i < RULE_BLOCK ? n - i : RULE_BLOCK, types + i);
+}
@@ -0,0 +1,82 @@
+#ifndef __RULE_ENGINE_H__
+#define __RULE_ENGINE_H__
+
+#include <stdint.h>
+
+#include "tcp_stall_state.h"
+#include "cmd_options.h"
+#include "output.h"
+
+/*
+ * Stall rules loaded at run time, see --rules. A rule file has the syntax
+ * of parser/rules.txt, plus '#' comments and parentheses:
+ *
+ *     condition cur_pkt_lost_num >= 1 && cur_pkt_dir == 2
+ *     type RETRANS_UNKNOWN
+ *     detail "retrans, unknown"
+ *
+ * The first rule whose condition holds classifies a stall, UNKNOWN_ISSUE
+ * if none does. The conditions are compiled into a straight-line program
+ * over the fields of struct tcp_stall_state, in which every distinct
+ * subexpression, e.g. `cur_pkt_dir == 2' or `3*max_snd_seg_size', is one
+ * instruction writing one slot: it is evaluated once per stall however
+ * many rules use it. Values are typed as the fields are (int, uint32_t or
+ * double) and the arithmetic follows C, as the generated parse_stall().
+ *
+ * The program runs over blocks of RULE_BLOCK stalls, see classify_stalls().
+ */
+#define RULE_MAX_SLOTS 1024
+#define RULE_MAX_RULES 256
+// the ints of a vector register, wider vectors are split into scalars
+#ifdef __AVX2__
+#define RULE_LANES 8
+#else
+#define RULE_LANES 4
+#endif
+#define RULE_BLOCK 64
+
+// types of the values
+enum { RV_INT, RV_UINT, RV_DOUBLE };
+
+union rule_value {
+	int64_t i; // an int or an uint32_t
+	double d;
+};
+
+struct rule_insn {
+	uint8_t op;
+	uint8_t type; // of the result
+	uint16_t a, b; // operand slots
+	union rule_value imm; // the constant, or the offset of the field
+};
+
+struct rule_set {
+	char *path;
+	int insn_num;
+	struct rule_insn insns[RULE_MAX_SLOTS];
+	int rule_num;
+	uint16_t cond[RULE_MAX_RULES]; // slot of the condition of a rule
+	// the last ones are of no matching rule
+	char *type[RULE_MAX_RULES + 1];
+	char *detail[RULE_MAX_RULES + 1];
+	// stalls by their types in the first set and in this one
+	uint64_t *table;
+};
+
+// NULL if the file could not be compiled, the errors are logged
+struct rule_set *load_rules(const char *path);
+void free_rules(struct rule_set *rs);
+// the index of the first matching rule of every stall, rs->rule_num if none
+void classify_stalls(const struct rule_set *rs, struct tcp_stall_state **tss, int n, int *types);
+
+// of --rules, in the order given
+extern struct rule_set *stall_rules[MAX_RULE_FILES];
+extern int stall_rule_num;
+
+int load_stall_rules(const char **paths, int num);
+void free_stall_rules();
+// types[set][stall] of n stalls, by all the sets
+void count_stall_types(int (*types)[RULE_BLOCK], int n);
+void dump_stall_table(struct out_stream *out);
+
+#endif
@@ -0,0 +1,159 @@
+#include "series_bin.h"
+#include "tcp_state.h"
+#include "log.h"
+#include "def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Rows are collected column by column in a buffer of the calling thread
+ * and written as one block when SERIES_BLOCK_ROWS rows are collected.
+ * The flows are written before the packets which refer to them.
+ */
+struct series_buf {
+	int rows;
+	int64_t time_ns[SERIES_BLOCK_ROWS];
+	uint32_t flow_id[SERIES_BLOCK_ROWS];
+	uint32_t seq[SERIES_BLOCK_ROWS];
+	int32_t inflight[SERIES_BLOCK_ROWS];
+	int32_t rwnd[SERIES_BLOCK_ROWS];
+	uint8_t dir[SERIES_BLOCK_ROWS];
+
+	int flow_num;
+	struct series_flow flows[SERIES_BLOCK_ROWS];
+};
+
+static struct out_stream file_stream;
+struct out_stream *series_file = NULL;
+static uint32_t next_flow_id = 0;
+
+static __thread struct series_buf *sbuf = NULL;
+
+int open_series_file(const char *path)
+{
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG(ERROR, "Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct series_file_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SERIES_MAGIC, sizeof(hdr.magic));
+	hdr.version = SERIES_VERSION;
+
+	out_stream_init(&file_stream, fd);
+	out_write(&file_stream, &hdr, sizeof(hdr));
+	series_file = &file_stream;
+
+	// the rows of the main thread are lost on exit() otherwise
+	atexit(close_series_file);
+	return 0;
+}
+
+void close_series_file()
+{
+	if (series_file == NULL)
+		return;
+
+	series_thread_cleanup(series_file);
+	out_flush(series_file);
+	out_sync();
+	close(series_file->fd);
+	series_file = NULL;
+}
+
+static struct series_buf *get_sbuf()
+{
+	if (sbuf == NULL) {
+		sbuf = MALLOC_N(struct series_buf, 1);
+		sbuf->rows = 0;
+		sbuf->flow_num = 0;
+	}
+
+	return sbuf;
+}
+
+static void write_block(struct out_stream *out, int type, int rows, uint32_t size)
+{
+	struct series_block_hdr hdr;
+	hdr.type = type;
+	hdr.rows = rows;
+	hdr.size = size;
+	hdr.reserved = 0;
+	out_write(out, &hdr, sizeof(hdr));
+}
+
+void series_flush(struct out_stream *out)
+{
+	struct series_buf *b = sbuf;
+	if (b == NULL)
+		return;
+
+	if (b->flow_num > 0) {
+		write_block(out, SERIES_BLOCK_FLOWS, b->flow_num, b->flow_num*sizeof(struct series_flow));
+		out_write(out, b->flows, b->flow_num*sizeof(struct series_flow));
+		b->flow_num = 0;
+	}
+
+	if (b->rows > 0) {
+		int n = b->rows;
+		static const uint8_t pad[8] = { 0 };
+		write_block(out, SERIES_BLOCK_PKTS, n, SERIES_PKT_BODY_SIZE(n));
+		out_write(out, b->time_ns, n*sizeof(int64_t));
+		out_write(out, b->flow_id, n*sizeof(uint32_t));
+		out_write(out, b->seq, n*sizeof(uint32_t));
+		out_write(out, b->inflight, n*sizeof(int32_t));
+		out_write(out, b->rwnd, n*sizeof(int32_t));
+		out_write(out, b->dir, n*sizeof(uint8_t));
+		out_write(out, pad, SERIES_PKT_BODY_SIZE(n) - n*SERIES_PKT_ROW_SIZE);
+		b->rows = 0;
+	}
+}
+
+uint32_t series_new_flow(struct tcp_key *key)
+{
+	struct series_buf *b = get_sbuf();
+	if (b->flow_num == SERIES_BLOCK_ROWS)
+		series_flush(OUTPUT_STREAM(series_out));
+
+	uint32_t id = __sync_fetch_and_add(&next_flow_id, 1);
+	struct series_flow *f = &b->flows[b->flow_num++];
+	f->flow_id = id;
+	f->server_addr = key->addr[0].s_addr;
+	f->client_addr = key->addr[1].s_addr;
+	f->server_port = key->port[0];
+	f->client_port = key->port[1];
+
+	return id;
+}
+
+void series_add(uint32_t flow_id, int64_t time_ns, uint32_t seq,
+		int32_t inflight, int32_t rwnd, int dir)
+{
+	struct series_buf *b = get_sbuf();
+	int i = b->rows++;
+	b->time_ns[i] = time_ns;
+	b->flow_id[i] = flow_id;
+	b->seq[i] = seq;
+	b->inflight[i] = inflight;
+	b->rwnd[i] = rwnd;
+	b->dir[i] = dir;
+
+	if (b->rows == SERIES_BLOCK_ROWS)
+		series_flush(OUTPUT_STREAM(series_out));
+}
+
+void series_thread_cleanup(struct out_stream *out)
+{
+	if (sbuf == NULL)
+		return;
+
+	series_flush(out);
+	FREE_N(sbuf);
+	sbuf = NULL;
+}
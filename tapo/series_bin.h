@@ -0,0 +1,78 @@
+#ifndef __SERIES_BIN_H__
+#define __SERIES_BIN_H__
+
+#include <stdint.h>
+
+/*
+ * Binary columnar format of the per-packet series, see -w.
+ *
+ * The file starts with a struct series_file_hdr and is followed by
+ * self-contained blocks, each a struct series_block_hdr and its body.
+ * The files of the workers are simply concatenated, so flow blocks and
+ * packet blocks of different flows interleave; a reader has to collect the
+ * flow blocks to name the flows. All values are in host byte order except
+ * the addresses and ports of struct series_flow.
+ *
+ * The body of a packet block holds its columns one after another, each
+ * with `rows' values:
+ *
+ *     int64_t  time_ns[rows]   time since the start of the flow
+ *     uint32_t flow_id[rows]
+ *     uint32_t seq[rows]       relative seq (out) or ack_seq (in)
+ *     int32_t  inflight[rows]  snd_nxt - snd_una after the packet
+ *     int32_t  rwnd[rows]      receive window of the client
+ *     uint8_t  dir[rows]       DIR_IN or DIR_OUT
+ *
+ * and is padded to a multiple of 8 bytes.
+ */
+#define SERIES_MAGIC "TAPOSER1"
+#define SERIES_VERSION 1
+#define SERIES_BLOCK_ROWS 4096
+
+enum { SERIES_BLOCK_FLOWS = 1, SERIES_BLOCK_PKTS };
+
+struct series_file_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct series_block_hdr {
+	uint32_t type;
+	uint32_t rows;
+	uint32_t size; // bytes of the body
+	uint32_t reserved;
+};
+
+// a row of a flow block
+struct series_flow {
+	uint32_t flow_id;
+	uint32_t server_addr;
+	uint32_t client_addr;
+	uint16_t server_port;
+	uint16_t client_port;
+};
+
+#define SERIES_PKT_ROW_SIZE (8 + 4 + 4 + 4 + 4 + 1)
+#define SERIES_PKT_BODY_SIZE(rows) (((rows) * SERIES_PKT_ROW_SIZE + 7) & ~7)
+
+#ifndef SERIES_READER
+
+#include "tcp_base.h"
+#include "output.h"
+
+// the stream of the -w file, NULL if the series is written as text
+extern struct out_stream *series_file;
+
+int open_series_file(const char *path);
+void close_series_file();
+
+uint32_t series_new_flow(struct tcp_key *key);
+void series_add(uint32_t flow_id, int64_t time_ns, uint32_t seq,
+		int32_t inflight, int32_t rwnd, int dir);
+void series_flush(struct out_stream *out);
+void series_thread_cleanup(struct out_stream *out);
+
+#endif
+
+#endif
@@ -0,0 +1,311 @@
+#include "server_set.h"
+#include "log.h"
+#include "def.h"
+#include "malloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#define TBL24_SIZE (1 << 24)
+#define TBL8_GROUP 256
+
+uint16_t *server_tbl24 = NULL;
+uint16_t *server_tbl8 = NULL;
+struct server_rule *server_rules = NULL;
+static int rule_num = 0;
+static int rule_cap = 0;
+static int tbl8_num = 0;
+
+static int parse_prefix(const char *s, uint32_t *addr, int *plen)
+{
+	char buf[64];
+	strncpy(buf, s, sizeof(buf)-1);
+	buf[sizeof(buf)-1] = '\0';
+
+	*plen = 32;
+	char *slash = strchr(buf, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		char *end;
+		long l = strtol(slash+1, &end, 10);
+		if (*end != '\0' || end == slash+1 || l < 0 || l > 32)
+			return -1;
+		*plen = l;
+	}
+
+	struct in_addr in;
+	if (inet_aton(buf, &in) != 1)
+		return -1;
+
+	uint32_t mask = *plen ? ~0U << (32 - *plen) : 0;
+	*addr = ntohl(in.s_addr) & mask;
+	return 0;
+}
+
+// "80", "8000-8100" or a comma separated list of them
+static int parse_ports(const char *s, struct server_rule *r)
+{
+	while (*s != '\0') {
+		char *end;
+		long lo = strtol(s, &end, 10), hi = lo;
+		if (end == s)
+			return -1;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if (end == s)
+				return -1;
+		}
+		if (lo < 0 || hi > 65535 || lo > hi || (*end != ',' && *end != '\0'))
+			return -1;
+
+		if (r->range_num == MAX_PORT_RANGES) {
+			LOG(ERROR, "too many port ranges, at most %d.\n", MAX_PORT_RANGES);
+			return -1;
+		}
+		r->ranges[r->range_num].lo = lo;
+		r->ranges[r->range_num].hi = hi;
+		r->range_num += 1;
+
+		s = (*end == ',') ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+// the rules of the same prefix are merged
+int add_server(const char *prefix, const char *ports)
+{
+	uint32_t addr;
+	int plen;
+	if (parse_prefix(prefix, &addr, &plen) != 0) {
+		LOG(ERROR, "invalid server address %s.\n", prefix);
+		return -1;
+	}
+
+	int i = 0;
+	for (; i < rule_num; i++) {
+		if (server_rules[i].addr == addr && server_rules[i].plen == plen)
+			break;
+	}
+
+	if (i == rule_num) {
+		if (rule_num == MAX_SERVER_RULES) {
+			LOG(ERROR, "too many server prefixes, at most %d.\n", MAX_SERVER_RULES);
+			return -1;
+		}
+		if (rule_num == rule_cap) {
+			rule_cap = rule_cap ? rule_cap*2 : 16;
+			server_rules = realloc(server_rules, rule_cap*sizeof(struct server_rule));
+			if (server_rules == NULL) {
+				LOG(ERROR, "realloc server rules failed: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+		memset(&server_rules[i], 0, sizeof(struct server_rule));
+		server_rules[i].addr = addr;
+		server_rules[i].plen = plen;
+		rule_num += 1;
+	}
+
+	if (parse_ports(ports, &server_rules[i]) != 0) {
+		LOG(ERROR, "invalid server ports %s.\n", ports);
+		return -1;
+	}
+
+	return 0;
+}
+
+int load_server_file(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		LOG(ERROR, "Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[1024];
+	int lineno = 0, ret = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno += 1;
+		char *p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+
+		char prefix[64], ports[512];
+		int n = sscanf(line, "%63s %511s", prefix, ports);
+		if (n <= 0)
+			continue;
+		if (n != 2 || add_server(prefix, ports) != 0) {
+			LOG(ERROR, "%s:%d: expect \"prefix ports\".\n", path, lineno);
+			ret = -1;
+			break;
+		}
+	}
+
+	fclose(fp);
+	return ret;
+}
+
+static int cmp_plen(const void *a, const void *b)
+{
+	const struct server_rule *ra = (const struct server_rule *)a,
+		  *rb = (const struct server_rule *)b;
+	if (ra->plen != rb->plen)
+		return ra->plen - rb->plen;
+	return ra->addr < rb->addr ? -1 : (ra->addr > rb->addr);
+}
+
+static void add_tbl_entry(struct server_rule *r, uint16_t v)
+{
+	if (r->plen <= 24) {
+		uint32_t b = r->addr >> 8, n = 1U << (24 - r->plen), i = 0;
+		for (; i < n; i++)
+			server_tbl24[b + i] = v;
+		return;
+	}
+
+	uint32_t idx = r->addr >> 8;
+	uint16_t e = server_tbl24[idx];
+	if (!(e & TBL8_FLAG)) {
+		// a new group inherits the entry of the shorter prefix
+		uint32_t g = tbl8_num++, i = 0;
+		for (; i < TBL8_GROUP; i++)
+			server_tbl8[g*TBL8_GROUP + i] = e;
+		e = server_tbl24[idx] = TBL8_FLAG | g;
+	}
+
+	uint32_t base = (uint32_t)(e & ~TBL8_FLAG) * TBL8_GROUP + (r->addr & 0xff);
+	uint32_t n = 1U << (32 - r->plen), i = 0;
+	for (; i < n; i++)
+		server_tbl8[base + i] = v;
+}
+
+/*
+ * The rules are inserted from the shortest prefix, so a longer prefix
+ * overwrites the entries of the shorter ones it falls in. Before a rule is
+ * inserted, the entry of its address is the longest prefix covering it,
+ * whose ranges already include those of all the shorter ones.
+ */
+int build_server_set()
+{
+	if (rule_num == 0) {
+		LOG(ERROR, "no server is given.\n");
+		return -1;
+	}
+
+	qsort(server_rules, rule_num, sizeof(struct server_rule), cmp_plen);
+
+	int i = 0, groups = 0;
+	for (; i < rule_num; i++) {
+		if (server_rules[i].plen > 24)
+			groups += 1;
+	}
+
+	// the pages never written stay unmapped
+	server_tbl24 = calloc(TBL24_SIZE, sizeof(uint16_t));
+	server_tbl8 = calloc((size_t)MAX(groups, 1) * TBL8_GROUP, sizeof(uint16_t));
+	if (server_tbl24 == NULL || server_tbl8 == NULL) {
+		LOG(ERROR, "malloc server table failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < rule_num; i++) {
+		struct server_rule *r = &server_rules[i];
+		uint16_t e = server_entry(r->addr);
+		struct server_rule *q = e ? &server_rules[e - 1] : NULL;
+
+		int n = (q ? q->match_num : 0) + r->range_num;
+		r->match = MALLOC_N(struct port_range, n);
+		r->match_num = 0;
+		if (q != NULL) {
+			memcpy(r->match, q->match, q->match_num*sizeof(struct port_range));
+			r->match_num = q->match_num;
+		}
+		memcpy(r->match + r->match_num, r->ranges, r->range_num*sizeof(struct port_range));
+		r->match_num += r->range_num;
+
+		add_tbl_entry(r, i + 1);
+	}
+
+	return 0;
+}
+
+static void append_str(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static void append_str(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+{
+	char tmp[128];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+
+	if (*len + n + 1 > *cap) {
+		*cap = MAX(*cap * 2, *len + n + 1);
+		*buf = realloc(*buf, *cap);
+		if (*buf == NULL) {
+			LOG(ERROR, "realloc filter failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	memcpy(*buf + *len, tmp, n + 1);
+	*len += n;
+}
+
+static void append_rule(char **buf, size_t *len, size_t *cap, struct server_rule *r, const char *side)
+{
+	struct in_addr in;
+	in.s_addr = htonl(r->addr);
+	append_str(buf, len, cap, "(%s net %s/%d && (", side, inet_ntoa(in), r->plen);
+
+	int i = 0;
+	for (; i < r->range_num; i++) {
+		struct port_range *pr = &r->ranges[i];
+		if (pr->lo == pr->hi)
+			append_str(buf, len, cap, "%s%s port %hu", i ? " || " : "", side, pr->lo);
+		else
+			append_str(buf, len, cap, "%s%s portrange %hu-%hu", i ? " || " : "", side, pr->lo, pr->hi);
+	}
+	append_str(buf, len, cap, "))");
+}
+
+/*
+ * The filter expression of all the servers, allocated with malloc():
+ * tcp && ((src net A && src portrange ...) || ... || (dst net A && ...))
+ */
+char *server_filter_expr()
+{
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	append_str(&buf, &len, &cap, "tcp && (");
+
+	int i = 0;
+	for (; i < rule_num; i++) {
+		append_str(&buf, &len, &cap, "%s", i ? " || " : "");
+		append_rule(&buf, &len, &cap, &server_rules[i], "src");
+		append_str(&buf, &len, &cap, " || ");
+		append_rule(&buf, &len, &cap, &server_rules[i], "dst");
+	}
+	append_str(&buf, &len, &cap, ")");
+
+	return buf;
+}
+
+void cleanup_server_set()
+{
+	int i = 0;
+	for (; i < rule_num; i++)
+		FREE_N(server_rules[i].match);
+	free(server_rules);
+	free(server_tbl24);
+	free(server_tbl8);
+	server_rules = NULL;
+	server_tbl24 = NULL;
+	server_tbl8 = NULL;
+	rule_num = rule_cap = tbl8_num = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef __SERVER_SET_H__
+#define __SERVER_SET_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * The servers to analyse: a set of (prefix, port ranges) rules, from -s/-p
+ * and the lines of the -S file, e.g.
+ *
+ *     # VIPs of the cluster
+ *     10.21.0.0/24   80,443
+ *     10.21.1.7      8000-8100
+ *
+ * The prefixes are compiled into a DIR-24-8 table: the upper 24 bits of an
+ * address index a table of 2^24 entries, and prefixes longer than 24 bits
+ * get a second level group of 256 entries. An address matches its longest
+ * prefix; the port ranges of a rule include those of the shorter prefixes
+ * covering it.
+ */
+#define MAX_SERVER_RULES 32767
+#define MAX_PORT_RANGES 64
+
+struct port_range {
+	uint16_t lo;
+	uint16_t hi;
+};
+
+struct server_rule {
+	uint32_t addr; // host byte order
+	int plen;
+	int range_num;
+	struct port_range ranges[MAX_PORT_RANGES];
+	// with the ranges of the covering prefixes
+	int match_num;
+	struct port_range *match;
+};
+
+int add_server(const char *prefix, const char *ports);
+int load_server_file(const char *path);
+int build_server_set();
+char *server_filter_expr();
+void cleanup_server_set();
+
+extern uint16_t *server_tbl24;
+extern uint16_t *server_tbl8;
+extern struct server_rule *server_rules;
+
+#define TBL8_FLAG 0x8000
+
+// 1 + the index of the longest rule matching addr (host byte order), 0 if none
+static inline uint16_t server_entry(uint32_t a)
+{
+	uint16_t e = server_tbl24[a >> 8];
+	if (e & TBL8_FLAG)
+		e = server_tbl8[(uint32_t)(e & ~TBL8_FLAG) << 8 | (a & 0xff)];
+	return e;
+}
+
+// whether addr:port (network byte order) is one of the servers
+static inline int is_server(struct in_addr addr, uint16_t port)
+{
+	uint16_t e = server_entry(ntohl(addr.s_addr));
+	if (e == 0)
+		return 0;
+
+	struct server_rule *r = &server_rules[e - 1];
+	uint16_t p = ntohs(port);
+	int i = 0;
+	for (; i < r->match_num; i++) {
+		if (p >= r->match[i].lo && p <= r->match[i].hi)
+			return 1;
+	}
+
+	return 0;
+}
+
+#endif
@@ -3,13 +3,13 @@
 
 #include <string.h>
 
-#define G 200 // current Linux implementation
+#define G 200000 // 200ms, current Linux implementation
 #define K 4
 
 void init_rtt(struct rtt_t *rtt)
 {
 	memset(rtt, 0, sizeof(struct rtt_t));
-	rtt->rto = TIME_TO_TICK(1); // according to RFC 6298
+	rtt->rto = SEC_TO_TICK(1); // according to RFC 6298
 }
 
 /* Since we do not need exactly the same srtt/rto estimation as the 
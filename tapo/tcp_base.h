@@ -1,6 +1,8 @@
 #ifndef __TCP_BASE_H__
 #define __TCP_BASE_H__
 
+#include <stdint.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 
 // including tcp state
@@ -31,9 +33,26 @@ struct rtt_t {
 	uint32_t rto;
 };
 
-// 1 tick = 0.001 second
-#define TIME_TO_TICK(t) ((int)((t)*1000))
-#define TICK_TO_TIME(tick) ((double)(tick)/1000.0)
+/*
+ * Capture times are integer nanoseconds since the epoch. Inside the tool
+ * a struct pcap_pkthdr carries nanoseconds in ts.tv_usec, the convention
+ * of libpcap's PCAP_TSTAMP_PRECISION_NANO.
+ */
+typedef int64_t nstime_t;
+#define NSEC_PER_USEC 1000LL
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC 1000000000LL
+#define NS_TO_SEC(ns) ((double)(ns) / NSEC_PER_SEC)
+
+static inline nstime_t pkt_time(const struct timeval *tv)
+{
+	return (nstime_t)tv->tv_sec * NSEC_PER_SEC + tv->tv_usec;
+}
+
+// 1 tick = 1 microsecond
+#define NS_TO_TICK(ns) ((ns) / NSEC_PER_USEC)
+#define SEC_TO_TICK(s) ((s) * 1000000)
+#define TICK_TO_TIME(tick) ((double)(tick)/1000000.0)
 int rtt_thres(struct rtt_t *rtt);
 void init_rtt(struct rtt_t *rtt);
 void update_rtt(struct rtt_t *rtt, int32_t m);
@@ -6,20 +6,103 @@
 #include <string.h>
 #include <assert.h>
 
+static inline uint32_t load32(const u_char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static inline uint64_t load64(const u_char *p)
+{
+	return (uint64_t)load32(p) << 32 | load32(p+4);
+}
+
+static inline void load_ts(struct tcp_option *opt, const u_char *p)
+{
+	opt->ts.tv_sec = load32(p);
+	opt->ts.tv_usec = load32(p+4);
+	SET_FLAG(opt, TCPOPT_TIMESTAMP);
+}
+
+// a SACK option of len bytes, n blocks
+static inline int load_sack(struct tcp_option *opt, const u_char *p, int len)
+{
+	int n = (len - 4) / 8, i = 0;
+	if (len != 4 + n*8 || n < 1 || n > 4 || load32(p) != (0x01010500u | (n*8+2)))
+		return 0;
+
+	for (; i < n; i++) {
+		opt->sack.block[i].begin = load32(p+4+i*8);
+		opt->sack.block[i].end = load32(p+8+i*8);
+	}
+	opt->sack.num = n;
+	SET_FLAG(opt, TCPOPT_SACK);
+	return 1;
+}
+
+/*
+ * The layouts sent by the common stacks, matched by whole words:
+ *
+ *     NOP NOP TS                          data and ACKs
+ *     NOP NOP TS NOP NOP SACK             ACKs with SACK
+ *     NOP NOP SACK                        ACKs with SACK, no timestamps
+ *     MSS SACK_PERM TS NOP WSCALE         SYN of Linux
+ *
+ * Return 0 if the options are laid out otherwise.
+ */
+static int get_common_option(const u_char *p, int len, struct tcp_option *opt)
+{
+	if (len >= 12 && load32(p) == 0x0101080a) {
+		if (len > 12 && !load_sack(opt, p+12, len-12))
+			return 0;
+		load_ts(opt, p+4);
+		return 1;
+	}
+
+	if (load_sack(opt, p, len))
+		return 1;
+
+	if (len == 20 && (load64(p) & 0xffff0000ffffffffULL) == 0x020400000402080aULL &&
+			(load32(p+16) >> 8) == 0x010303) {
+		opt->mss = load32(p) & 0xffff;
+		opt->sack_ok = 1;
+		opt->wscale = p[19];
+		load_ts(opt, p+8);
+		SET_FLAG(opt, TCPOPT_MSS);
+		SET_FLAG(opt, TCPOPT_SACK_PERM);
+		SET_FLAG(opt, TCPOPT_WSCALE);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Only opt_flag and sack.num are cleared, the other fields are valid if
+ * their option is flagged.
+ */
 int get_tcp_option(struct tcphdr *th, struct tcp_option *ptcp_opt)
 {
-	memset(ptcp_opt, 0, sizeof(struct tcp_option));
+	ptcp_opt->opt_flag = 0;
+	ptcp_opt->sack.num = 0;
 
 	char *options = TCP_OPT(th);
 	int len = TCP_OPT_LEN(th);
 	if (len <= 0) 
 		return 0;
 
+	if (get_common_option((const u_char *)options, len, ptcp_opt))
+		return 0;
+	// a partly matched layout may have set some
+	ptcp_opt->opt_flag = 0;
+	ptcp_opt->sack.num = 0;
+
 	int opt_code = 0;
 	int opt_len = 0;
 	int itr = 0;
 	while (itr < len) {
-		opt_code = (int)(options[itr]);
+		opt_code = (u_char)options[itr];
 
 		if (opt_code == TCPOPT_EOL)
 			return 0;
@@ -28,7 +111,7 @@ int get_tcp_option(struct tcphdr *th, struct tcp_option *ptcp_opt)
 			continue;
 		}
 
-	   	if (IS_FLAG_SET(ptcp_opt,opt_code)) {
+	   	if (opt_code < TCPOPT_LIMIT && IS_FLAG_SET(ptcp_opt,opt_code)) {
 	   		LOG(DEBUG, "opt_code[%d] already set\n", opt_code);
 	   		break;
 	   	}	
@@ -54,7 +137,7 @@ int get_tcp_option(struct tcphdr *th, struct tcp_option *ptcp_opt)
 	   			break;	
 
 	   		case TCPOPT_SACK:
-	   			if (opt_len % 8 != 0) {
+	   			if (opt_len % 8 != 0 || opt_len > 32) {
 	   				LOG(ERROR, "sack option is invalid, length = %d.\n", opt_len);
 	   				return -1;
 	   			}		
@@ -31,6 +31,7 @@ struct tcp_option {
 	struct timeval ts;
 };
 
+// the fields of the options not flagged in opt_flag are not set
 int get_tcp_option(struct tcphdr *th, struct tcp_option *ptcpopt);
 
 #endif
@@ -3,47 +3,136 @@
 #include "log.h"
 #include "def.h"
 #include "cmd_options.h"
+#include "pcap_mmap.h"
+#include "pcap_merge.h"
+#include "pcap_decomp.h"
+#include "pcap_index.h"
+#include "server_set.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <net/ethernet.h>
 
 static int offset = 0;
 static struct bpf_program fp;
+// tcp only, for the readers of mapped files: get_tcp_hdr() classifies the
+// servers by the table of server_set.h, faster than fp lists them
+static struct bpf_program tcp_fp;
+
+// offline files are read by the zero-copy reader if its format is known
+static struct mmap_pcap mfile;
+static int use_mmap = 0;
+// several files are merged by timestamp
+static int use_merge = 0;
+// --from/--to/--flow seek through the index of the file
+static int use_index = 0;
+
+// the ring of the single-threaded mode, the workers open their own ones
+int use_tpacket = 0;
+static struct tpacket_ring ring;
+// pcap_open_live() gives microseconds, all the other readers nanoseconds
+static int usec_ts = 0;
 
 pcap_t *pcap_init()
 {
 	pcap_t *handle;
 	char errbuf[PCAP_ERRBUF_SIZE];
-	if (pcap_type == Offline) {
-		if(!(handle = pcap_open_offline(pcap_filename, errbuf))) {
+	if (pcap_type == Offline && pcap_file_num > 1) {
+		int link_type;
+		uint32_t snaplen;
+		if (merge_open(pcap_files, pcap_file_num, &link_type, &snaplen) != 0)
+			exit(1);
+		if (!(handle = pcap_open_dead(link_type, snaplen ? snaplen : 65535))) {
+			LOG(ERROR, "Could not create pcap handle.\n");
+			exit(1);
+		}
+		use_merge = 1;
+	}
+	else if (pcap_type == Offline && mmap_pcap_open(&mfile, pcap_files[0]) == 0) {
+		// a dead handle is still needed to compile the filter
+		if (!(handle = pcap_open_dead(mfile.link_type, mfile.snaplen ? mfile.snaplen : 65535))) {
+			LOG(ERROR, "Could not create pcap handle.\n");
+			exit(1);
+		}
+		use_mmap = 1;
+	}
+	else if (pcap_type == Offline) {
+		if(!(handle = pcap_open_file(pcap_files[0], errbuf))) {
 			LOG(ERROR, "Could not open pcap file: %s\n", errbuf);
 			exit(1);
 		}
 	}
+	else if (tpacket_supported(pcap_intf)) {
+		// the filter is compiled for the ethernet frames of the ring
+		if (!(handle = pcap_open_dead(LINKTYPE_ETHERNET, LIVE_SNAPLEN))) {
+			LOG(ERROR, "Could not create pcap handle.\n");
+			exit(1);
+		}
+		use_tpacket = 1;
+	}
 	else {
-		if (!(handle = pcap_open_live(pcap_intf, 96, 1, -1, errbuf))) {
+		if (!(handle = pcap_open_live(pcap_intf, LIVE_SNAPLEN, 1, -1, errbuf))) {
 			LOG(ERROR, "Could not open the device: %s\n", errbuf);
 			exit(1);
 		}
+		usec_ts = pcap_get_tstamp_precision(handle) != PCAP_TSTAMP_PRECISION_NANO;
 	}
 
 	// set pcap filter
-	char pf_buf[2048];
-#define pf_fmt "tcp && ((src host %s && src port %d) || (dst host %s && dst port %d))"
-	snprintf(pf_buf, sizeof(pf_buf), pf_fmt, server_ip, server_port, server_ip, server_port);
-	if (pcap_compile(handle, &fp, pf_buf, 0, 0) == -1) {
+	char *pf_buf = server_filter_expr();
+	if (pcap_compile(handle, &fp, pf_buf, 1, 0) == -1) {
 	    LOG(ERROR, "Could not parse filter %s: %s.\n", pf_buf, pcap_geterr(handle));
 	    exit(1);
 	}
-	
-	if (pcap_setfilter(handle, &fp) == -1) {
+
+	// the kernel refuses long programs, get_tcp_hdr() still checks the servers
+	if (fp.bf_len > BPF_MAX_INSNS) {
+		LOG(WARN, "filter of %u instructions is too long, only tcp is filtered.\n", fp.bf_len);
+		pcap_freecode(&fp);
+		strcpy(pf_buf, "tcp");
+		if (pcap_compile(handle, &fp, pf_buf, 1, 0) == -1) {
+			LOG(ERROR, "Could not parse filter %s: %s.\n", pf_buf, pcap_geterr(handle));
+			exit(1);
+		}
+	}
+
+	if ((use_mmap || use_merge) && pcap_compile(handle, &tcp_fp, "tcp", 1, 0) == -1) {
+		LOG(ERROR, "Could not parse filter tcp: %s.\n", pcap_geterr(handle));
+		exit(1);
+	}
+
+	if (use_merge && merge_start(&fp, &tcp_fp) != 0)
+		exit(1);
+
+	if (index_query()) {
+		if (!use_mmap) {
+			LOG(ERROR, "--from, --to and --flow need one uncompressed pcap or pcapng file.\n");
+			exit(1);
+		}
+		if (open_pcap_index(&mfile, pcap_files[0]) != 0)
+			exit(1);
+		use_index = 1;
+	}
+
+	if (!use_mmap && !use_tpacket && !use_merge && pcap_setfilter(handle, &fp) == -1) {
 	    LOG(ERROR, "Could not apply filter %s: %s.\n", pf_buf, pcap_geterr(handle));
 	    exit(1);
 	}
+	free(pf_buf);
+
+	if (set_link_type(pcap_datalink(handle)) != 0)
+		exit(1);
 
-	// get pcap link type
-	int link_type = pcap_datalink(handle);
+	if (use_tpacket && worker_num == 1 && pcap_open_ring(&ring, -1) != 0)
+		exit(1);
+
+	return handle;
+}
+
+// the offset of the ether type for get_ip_hdr()
+int set_link_type(int link_type)
+{
 	switch (link_type) {
 		case LINKTYPE_ETHERNET:
 			offset = 12;
@@ -53,14 +142,95 @@ pcap_t *pcap_init()
 			break;
 		default:
 			LOG(WARN, "Unknown link type (%x).\n", link_type);
-			exit(1);
+			return -1;
 	}
 
-	return handle;
+	return 0;
+}
+
+int pcap_open_ring(struct tpacket_ring *ring, int fanout_id)
+{
+	return tpacket_open(ring, pcap_intf, &fp, fanout_id);
+}
+
+// live captures wait for the first packet of a batch only
+static const u_char *next_pkt(pcap_t *handle, struct pcap_pkthdr *pph, int wait)
+{
+	if (use_tpacket)
+		return tpacket_next(&ring, pph, wait ? -1 : 0);
+	if (use_merge)
+		return merge_next(pph);
+
+	const u_char *pkt;
+	while ((pkt = use_index ? index_next(&mfile, pph) : mmap_pcap_next(&mfile, pph)) != NULL) {
+		if (pcap_offline_filter(&tcp_fp, pph, pkt))
+			return pkt;
+	}
+
+	return NULL;
+}
+
+static void add_pkt(struct pkt_vec *vec, const struct pcap_pkthdr *pph, const u_char *pkt)
+{
+	int i = vec->num, idx = vec->raw++;
+	struct tcphdr *th = get_tcp_hdr(pkt, pph->caplen, &vec->key[i], &vec->len[i], &vec->dir[i]);
+	if (th == NULL)
+		return;
+
+	vec->idx[i] = idx;
+	vec->time[i] = pkt_time(&pph->ts);
+	memcpy(vec->tcp_hdr[i], th, th->doff*4);
+	vec->num += 1;
 }
 
+static void dispatch_cb(u_char *user, const struct pcap_pkthdr *pph, const u_char *pkt)
+{
+	if (usec_ts) {
+		struct pcap_pkthdr h = *pph;
+		h.ts.tv_usec *= 1000;
+		add_pkt((struct pkt_vec *)user, &h, pkt);
+		return;
+	}
+	add_pkt((struct pkt_vec *)user, pph, pkt);
+}
+
+/*
+ * Read at most max packets (max <= PKT_BATCH) and decode them into vec.
+ * Return the number of packets read, 0 at the end of the capture.
+ */
+int pcap_next_batch(pcap_t *handle, struct pkt_vec *vec, int max)
+{
+	vec->num = 0;
+	vec->raw = 0;
+
+	if (use_mmap || use_tpacket || use_merge) {
+		struct pcap_pkthdr pph;
+		const u_char *pkt;
+		while (vec->raw < max && (pkt = next_pkt(handle, &pph, vec->raw == 0)) != NULL)
+			add_pkt(vec, &pph, pkt);
+		return vec->raw;
+	}
+
+	int ret;
+	do {
+		ret = pcap_dispatch(handle, max, dispatch_cb, (u_char *)vec);
+	} while (ret == 0 && pcap_type == Online);
+
+	if (ret < 0 && ret != -2)
+		LOG(ERROR, "Could not read packets: %s\n", pcap_geterr(handle));
+
+	return vec->raw;
+}
+
+/*
+ * NULL if the ip header is not captured completely, nothing is read past
+ * *len bytes of the packet.
+ */
 struct ip *get_ip_hdr(const u_char *pkt_ptr, int *len)
 {
+	if (*len < offset + 2 + (int)sizeof(struct ip))
+		return NULL;
+
 	int ether_type = ntohs(*((uint16_t *)(pkt_ptr + offset)));
 	if (ether_type == ETHERTYPE_IP) {
 		pkt_ptr += (offset+2);
@@ -72,6 +242,8 @@ struct ip *get_ip_hdr(const u_char *pkt_ptr, int *len)
 
 	struct ip *ip_hdr = (struct ip *)pkt_ptr;
 	int iphdr_len = ip_hdr->ip_hl * 4;
+	if (iphdr_len < (int)sizeof(struct ip))
+		return NULL;
 	*len -= (offset+2+iphdr_len);
 	if (*len < 0)
 		return NULL;
@@ -79,8 +251,73 @@ struct ip *get_ip_hdr(const u_char *pkt_ptr, int *len)
 		return ip_hdr;
 }
 
+/*
+ * Get the tcp header and the tcp key of a captured packet, NULL if the tcp
+ * header is not captured completely or neither end is a server. The key is
+ * ordered as (server, client).
+ */
+struct tcphdr *get_tcp_hdr(const u_char *pkt_ptr, int cap_len,
+		struct tcp_key *key, int *payload_len, int *dir)
+{
+	int len = cap_len;
+	struct ip *ip_hdr = get_ip_hdr(pkt_ptr, &len);
+	if (ip_hdr == NULL)
+		return NULL;
+
+	if (len < (int)sizeof(struct tcphdr)) {
+		LOG(DEBUG, "tcp header is not captured completely.\n"); 
+		return NULL;
+	}
+
+	struct tcphdr *tcp_hdr = (struct tcphdr *)((u_char *)ip_hdr + ip_hdr->ip_hl*4);
+	int iphdr_len = ip_hdr->ip_hl*4;
+	int tcphdr_len = tcp_hdr->doff*4;
+
+	if (tcphdr_len > len) {
+		LOG(DEBUG, "tcp header is not captured completely.\n"); 
+		return NULL;
+	}
+
+	if (is_server(ip_hdr->ip_src, tcp_hdr->source)) {
+		key->addr[0] = ip_hdr->ip_src;
+		key->addr[1] = ip_hdr->ip_dst;
+		key->port[0] = tcp_hdr->source;
+		key->port[1] = tcp_hdr->dest;
+		*dir = DIR_OUT;
+	}
+	else if (is_server(ip_hdr->ip_dst, tcp_hdr->dest)) {
+		key->addr[0] = ip_hdr->ip_dst;
+		key->addr[1] = ip_hdr->ip_src;
+		key->port[0] = tcp_hdr->dest;
+		key->port[1] = tcp_hdr->source;
+		*dir = DIR_IN;
+	}
+	else {
+		return NULL;
+	}
+
+	*payload_len = ntohs(ip_hdr->ip_len) - iphdr_len - tcphdr_len;
+	return tcp_hdr;
+}
+
 void pcap_cleanup(pcap_t *handle)
 {
 	pcap_freecode(&fp);
+	pcap_freecode(&tcp_fp);
 	pcap_close(handle);
+	if (use_index) {
+		close_pcap_index();
+		use_index = 0;
+	}
+	if (use_mmap) {
+		mmap_pcap_close(&mfile);
+		use_mmap = 0;
+	}
+	if (use_merge) {
+		merge_close();
+		use_merge = 0;
+	}
+	decomp_cleanup();
+	if (use_tpacket && worker_num == 1)
+		tpacket_close(&ring);
 }
@@ -7,8 +7,47 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
+#include "tcp_base.h"
+#include "pcap_tpacket.h"
+
+// snaplen of live captures
+#define LIVE_SNAPLEN 96
+
+// the longest filter the kernel accepts, BPF_MAXINSNS
+#define BPF_MAX_INSNS 4096
+
+// the largest tcp header, 15*4 bytes
+#define MAX_TCPHDR_LEN 60
+
+/*
+ * A batch of decoded packets. The tcp headers are copied, since the
+ * packets returned by libpcap and the live rings are not valid across
+ * reads. idx is the position of the packet among the packets read for
+ * the batch, which includes the ones that could not be decoded.
+ */
+#define PKT_BATCH 64
+
+struct pkt_vec {
+	int num;
+	int raw; // packets read
+	int idx[PKT_BATCH];
+	struct tcp_key key[PKT_BATCH];
+	nstime_t time[PKT_BATCH];
+	int len[PKT_BATCH];
+	int dir[PKT_BATCH];
+	u_char tcp_hdr[PKT_BATCH][MAX_TCPHDR_LEN];
+};
+
+// live captures of the interface are read from TPACKET_V3 rings
+extern int use_tpacket;
+
 pcap_t *pcap_init();
+int pcap_next_batch(pcap_t *handle, struct pkt_vec *vec, int max);
+int pcap_open_ring(struct tpacket_ring *ring, int fanout_id);
+int set_link_type(int link_type);
 struct ip *get_ip_hdr(const u_char *pkt_ptr, int *cap_len);
+struct tcphdr *get_tcp_hdr(const u_char *pkt_ptr, int cap_len,
+		struct tcp_key *key, int *payload_len, int *dir);
 void pcap_cleanup();
 
 #endif
@@ -1,8 +1,11 @@
 #include "tcp_range_list.h"
 #include "tcp_base.h"
 #include "malloc.h"
+#include "def.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
 // void append_to_range_list(struct list_head *list, struct range_t *range)
 // {
@@ -64,3 +67,129 @@ void delete_range_list(struct list_head *list)
 {
 	delete_list(list, struct range_t, list);
 }
+
+static inline int64_t range_key(struct range_array *ra, uint32_t seq)
+{
+	return ra->last_key + (int32_t)(seq - ra->last_seq);
+}
+
+// the first range whose begin is not before key
+static int lower_index(struct range_array *ra, int64_t key)
+{
+	int low = 0, high = ra->num;
+	while (low < high) {
+		int mid = (low+high)/2;
+		if (ra->key[mid] < key)
+			low = mid+1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+void append_to_range_array(struct range_array *ra, uint32_t begin, uint32_t end)
+{
+	if (ra->num == ra->cap) {
+		ra->cap = ra->cap ? ra->cap*2 : 16;
+		ra->range = realloc(ra->range, ra->cap*sizeof(struct block_t));
+		ra->key = realloc(ra->key, ra->cap*sizeof(int64_t));
+		ra->prefix = realloc(ra->prefix, (ra->cap+1)*sizeof(uint64_t));
+		assert(ra->range != NULL && ra->key != NULL && ra->prefix != NULL);
+	}
+	if (ra->num == 0) {
+		ra->last_seq = begin;
+		ra->last_key = 0;
+		ra->prefix[0] = 0;
+	}
+
+	int64_t key = range_key(ra, begin);
+	ra->last_seq = begin;
+	ra->last_key = key;
+
+	// ranges mostly come in order, so this is usually an append
+	int pos = ra->num;
+	while (pos > 0 && ra->key[pos-1] > key)
+		pos -= 1;
+
+	memmove(&ra->range[pos+1], &ra->range[pos], (ra->num-pos)*sizeof(struct block_t));
+	memmove(&ra->key[pos+1], &ra->key[pos], (ra->num-pos)*sizeof(int64_t));
+	ra->range[pos].begin = begin;
+	ra->range[pos].end = end;
+	ra->key[pos] = key;
+	ra->num += 1;
+
+	int i = pos;
+	for (; i < ra->num; i++)
+		ra->prefix[i+1] = ra->prefix[i] + (ra->range[i].end - ra->range[i].begin);
+
+	ra->max_len = MAX(ra->max_len, end - begin);
+}
+
+// the same as list_range_size(): sum of the overlaps with [b, e)
+uint32_t range_array_size(struct range_array *ra, uint32_t b, uint32_t e)
+{
+	if (ra->num == 0 || !before(b, e))
+		return 0;
+
+	int64_t kb = range_key(ra, b), ke = range_key(ra, e);
+	int i1 = lower_index(ra, kb),
+		j = lower_index(ra, ke);
+
+	// ranges beginning inside the window
+	uint64_t size = ra->prefix[j] - ra->prefix[i1];
+	int k = MAX(i1, lower_index(ra, ke - ra->max_len));
+	for (; k < j; k++) {
+		if (after(ra->range[k].end, e))
+			size -= ra->range[k].end - e;
+	}
+
+	// ranges beginning before the window but reaching into it
+	k = lower_index(ra, kb - ra->max_len);
+	for (; k < i1; k++) {
+		if (after(ra->range[k].end, b))
+			size += MIN_SEQ(ra->range[k].end, e) - b;
+	}
+
+	return size;
+}
+
+void delete_range_array(struct range_array *ra)
+{
+	free(ra->range);
+	free(ra->key);
+	free(ra->prefix);
+	memset(ra, 0, sizeof(struct range_array));
+}
+
+void reserve_range_vec(struct range_vec *rv, int n)
+{
+	if (n > rv->cap) {
+		rv->cap = MAX(n, rv->cap*2);
+		rv->range = realloc(rv->range, rv->cap*sizeof(struct block_t));
+		assert(rv->range != NULL);
+	}
+}
+
+void list_to_range_vec(struct list_head *list, struct range_vec *rv)
+{
+	struct list_head *p;
+	int n = 0;
+	list_for_each(p, list)
+		n += 1;
+
+	reserve_range_vec(rv, n);
+	rv->num = 0;
+	list_for_each(p, list) {
+		struct range_t *node = list_entry(p, struct range_t, list);
+		rv->range[rv->num].begin = node->begin;
+		rv->range[rv->num].end = node->end;
+		rv->num += 1;
+	}
+}
+
+void delete_range_vec(struct range_vec *rv)
+{
+	free(rv->range);
+	memset(rv, 0, sizeof(struct range_vec));
+}
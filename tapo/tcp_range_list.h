@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "list.h"
+#include "tcp_base.h"
 
 struct range_t {
 	uint32_t begin;
@@ -10,10 +11,49 @@ struct range_t {
 	struct list_head list;
 };
 
+/*
+ * Ranges sorted by begin, with prefix sums of their sizes, so the total
+ * size inside a window is found by binary search. Ranges far below the
+ * window are never visited again.
+ *
+ * The begins are sorted as 64 bit keys, unwrapped against the last range
+ * appended, so a flow may retransmit over any span of sequence space. A
+ * sequence number is keyed right while it is within 2^31 of that range.
+ */
+struct range_array {
+	struct block_t *range;
+	int64_t *key; // key[i]: the unwrapped begin of range[i]
+	uint64_t *prefix; // prefix[i]: total size of range[0, i)
+	int num;
+	int cap;
+	uint32_t last_seq; // begin of the last range appended
+	int64_t last_key; // and its key
+	uint32_t max_len;
+};
+
+/*
+ * Ranges in a flat array whose storage is kept from one use to the next,
+ * so filling it again does not allocate once it is large enough.
+ */
+struct range_vec {
+	struct block_t *range;
+	int num;
+	int cap;
+};
+
 int in_range_list(uint32_t n, struct list_head *list);
 void append_to_range_list(struct list_head *list, uint32_t begin, uint32_t end);
 uint32_t list_size(struct list_head *list);
 uint32_t list_range_size(struct list_head *list, uint32_t b, uint32_t e);
 void delete_range_list(struct list_head *list);
 
+void append_to_range_array(struct range_array *ra, uint32_t begin, uint32_t end);
+uint32_t range_array_size(struct range_array *ra, uint32_t b, uint32_t e);
+void delete_range_array(struct range_array *ra);
+
+// make room for n ranges, those in rv are kept
+void reserve_range_vec(struct range_vec *rv, int n);
+void list_to_range_vec(struct list_head *list, struct range_vec *rv);
+void delete_range_vec(struct range_vec *rv);
+
 #endif
@@ -2,55 +2,98 @@
 #include "tcp_base.h"
 #include "malloc.h"
 
-void insert_seq_rtt(uint32_t ack_seq, double t, struct list_head *list)
+#include <string.h>
+#include <assert.h>
+
+#define RTT_RING_INIT_SIZE 16
+#define RING_AT(ring, i) ((ring)->buf[((ring)->head + (i)) & ((ring)->cap - 1)])
+
+static void grow_rtt_ring(struct rtt_ring *ring)
 {
-	struct seq_rtt_t *new = MALLOC(struct seq_rtt_t);
-	new->ack_seq = ack_seq;
-	new->time = t;
-	// just append the node to list tail
-	list_add_tail(&new->list, list);
+	uint32_t cap = ring->cap ? ring->cap*2 : RTT_RING_INIT_SIZE;
+	struct seq_rtt_t *buf = malloc(cap*sizeof(struct seq_rtt_t));
+	assert(buf != NULL);
+
+	uint32_t i = 0;
+	for (; i < ring->num; i++)
+		buf[i] = RING_AT(ring, i);
+
+	free(ring->buf);
+	ring->buf = buf;
+	ring->cap = cap;
+	ring->head = 0;
 }
-		
 
-static void delete_rtt_list_prev(struct list_head *p, struct list_head *list)
+void insert_seq_rtt(uint32_t ack_seq, nstime_t t, struct rtt_ring *ring)
 {
-	struct list_head *t = NULL;
-	while (p != list) {
-		t = p;
-		p = p->prev;
-		list_delete_entry(t);
-		FREE(list_entry(t, struct seq_rtt_t, list));
-	}
-}
+	// get_rtt() searches from the tail and stops at the first sample not
+	// after the ack, so the samples not before this one are unreachable
+	while (ring->num > 0 && !before(RING_AT(ring, ring->num-1).ack_seq, ack_seq))
+		ring->num -= 1;
+
+	if (ring->num == ring->cap)
+		grow_rtt_ring(ring);
 
+	struct seq_rtt_t *s = &RING_AT(ring, ring->num);
+	s->ack_seq = ack_seq;
+	s->time = t;
+	ring->num += 1;
+}
 
-int get_rtt(uint32_t ack, double t, struct list_head *list)
+void insert_ts_rtt(uint32_t tsval, nstime_t t, struct rtt_ring *ring)
 {
-	struct list_head *pos;
-	struct seq_rtt_t *node;
-	int found = 0;
-	// search reversely
-	list_for_each_prev(pos, list) {
-		node = list_entry(pos, struct seq_rtt_t, list);
-		if (ack == node->ack_seq) {
-			found = 1;
-			break;
-		}
-		else if (after(ack, node->ack_seq))
-			break;
+	// the segments sharing a TSval are timed by the first one
+	if (ring->num > 0 && !after(tsval, RING_AT(ring, ring->num-1).ack_seq))
+		return;
+
+	// a peer that never echoes does not make the ring grow
+	if (ring->num == TS_RTT_RING_SIZE) {
+		ring->head = (ring->head + 1) & (ring->cap - 1);
+		ring->num -= 1;
 	}
+	insert_seq_rtt(tsval, t, ring);
+}
 
-	int rtt = 0;
-	if (found == 1) {
-		rtt = TIME_TO_TICK(t - node->time);
-		delete_rtt_list_prev(pos, list);
+// the number of samples before ack
+static uint32_t lower_index(struct rtt_ring *ring, uint32_t ack)
+{
+	uint32_t low = 0, high = ring->num;
+	while (low < high) {
+		uint32_t mid = (low+high)/2;
+		if (before(RING_AT(ring, mid).ack_seq, ack))
+			low = mid+1;
+		else
+			high = mid;
 	}
 
+	return low;
+}
+
+int get_rtt(uint32_t ack, nstime_t t, struct rtt_ring *ring)
+{
+	uint32_t pos = lower_index(ring, ack);
+	if (pos == ring->num || RING_AT(ring, pos).ack_seq != ack)
+		return 0;
+
+	int rtt = NS_TO_TICK(t - RING_AT(ring, pos).time);
+
+	// drop the sample and all the older ones
+	ring->head = (ring->head + pos + 1) & (ring->cap - 1);
+	ring->num -= pos + 1;
+
 	return rtt;
 }
 
-void delete_rtt_list(struct list_head *list)
+// drop the samples of the segments acknowledged by snd_una
+void truncate_rtt_ring(struct rtt_ring *ring, uint32_t snd_una)
 {
-	delete_rtt_list_prev(list->prev, list);
+	uint32_t pos = lower_index(ring, snd_una);
+	ring->head = (ring->head + pos) & (ring->cap - 1);
+	ring->num -= pos;
 }
 
+void delete_rtt_ring(struct rtt_ring *ring)
+{
+	free(ring->buf);
+	memset(ring, 0, sizeof(struct rtt_ring));
+}
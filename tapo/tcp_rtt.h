@@ -2,25 +2,41 @@
 #define __TCP_RTT_H__
 
 #include <stdint.h>
-#include "list.h"
+
+#include "tcp_base.h"
 
 struct seq_rtt_t
 {
 	uint32_t ack_seq;
-	double time;
-	struct list_head list;
+	nstime_t time;
 };
 
-struct seq_time_t
+/*
+ * Send times of segments, keyed by the ack which acknowledges them. The
+ * ring is strictly increasing in ack_seq: a newer sample hides all the
+ * older ones with ack_seq not before it, so they are dropped on insert.
+ */
+struct rtt_ring
 {
-	uint32_t seq;
-	double time;
-	struct list_head list;
+	struct seq_rtt_t *buf;
+	uint32_t cap; // power of 2
+	uint32_t head;
+	uint32_t num;
 };
 
-void insert_seq_rtt(uint32_t ack_seq, double t, struct list_head *list);
-int get_rtt(uint32_t ack, double t, struct list_head *list);
-void delete_rtt_list(struct list_head *list);
-double get_first_send_time(uint32_t seq, double t, struct list_head *list);
+/*
+ * With --rtt ts the ring is keyed by the TSvals sent instead, with the
+ * time each one is first seen. An ACK echoing one gives a sample, see
+ * handle_in_pkt(); at most TS_RTT_RING_SIZE TSvals wait for their echo.
+ */
+#define TS_RTT_RING_SIZE 16
+
+void insert_seq_rtt(uint32_t ack_seq, nstime_t t, struct rtt_ring *ring);
+void insert_ts_rtt(uint32_t tsval, nstime_t t, struct rtt_ring *ring);
+// in ticks, 0 if no sample matches
+int get_rtt(uint32_t ack, nstime_t t, struct rtt_ring *ring);
+void truncate_rtt_ring(struct rtt_ring *ring, uint32_t snd_una);
+void delete_rtt_ring(struct rtt_ring *ring);
+nstime_t get_first_send_time(uint32_t seq, nstime_t t, struct rtt_ring *ring);
 
 #endif
@@ -1,111 +1,99 @@
 #include "tcp_sack.h"
 #include "tcp_range_list.h"
 #include "malloc.h"
+#include "def.h"
 #include <assert.h>
 #include <string.h>
 
 #define SACK sack->block
 
-int spurious_retrans(uint32_t snd_una, struct sack_block *sack, uint32_t *b, uint32_t *e)
+/*
+ * Sort up to four blocks by begin with a sorting network. The keys are the
+ * begins relative to snd_una, which orders them as before() does, and the
+ * index in the option, which keeps blocks with equal begins in their order.
+ */
+static void sort_blocks(uint32_t snd_una, struct sack_block *sack, int num, struct block_t *sorted)
 {
-	if (sack->num == 0)
-		return 0;
-
-	if (before(SACK[0].begin, snd_una)) {
-		*b = SACK[0].begin;
-		*e = MIN_SEQ(SACK[0].end, snd_una);
-		return (*e - *b);
-	}
-
-	if (sack->num > 1) {
-		if (!before(SACK[0].begin, SACK[1].begin) && \
-				!after(SACK[0].end, SACK[1].end)) {
-			*b = SACK[0].begin;
-			*e = SACK[0].end;
-			return (*e - *b);
-		}
-	}
-
-	return 0;
-}
-
-uint32_t sacked(uint32_t snd_una, struct sack_block *sack)
-{
-	if (sack->num == 0)
-		return 0;
-	else {
-		int i = 0;
-		uint32_t sacked = 0;
-		for (; i < sack->num; i++)
-			sacked += SACK[i].end - SACK[i].begin;
-
-		uint32_t t1, t2;
-		return sacked - spurious_retrans(snd_una, sack, &t1, &t2);
-	}
-}
-
-uint32_t max_sack_ack(struct sack_block *sack)
-{
-	uint32_t sack_ack = SACK[0].end;
-	int i = 1;
-	for (; i < sack->num; i++) {
-		if (after(SACK[i].end, sack_ack))
-			sack_ack = SACK[i].end;
+	uint64_t k[4] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+	int i = 0;
+	for (; i < num; i++)
+		k[i] = (uint64_t)(SACK[i].begin - snd_una + 0x80000000u) << 32 | i;
+
+#define CMP_SWAP(a, b) \
+	do { \
+		uint64_t lo = MIN(k[a], k[b]), hi = MAX(k[a], k[b]); \
+		k[a] = lo; \
+		k[b] = hi; \
+	} while (0)
+	CMP_SWAP(0, 1);
+	CMP_SWAP(2, 3);
+	CMP_SWAP(0, 2);
+	CMP_SWAP(1, 3);
+	CMP_SWAP(1, 2);
+#undef CMP_SWAP
+
+	// all four are written, those beyond num are empty
+	for (i = 0; i < 4; i++) {
+		if (i < num)
+			sorted[i] = SACK[k[i] & 3];
+		else
+			sorted[i].begin = sorted[i].end = 0;
 	}
-
-	return sack_ack;
 }
 
-void normalize(struct sack_block *sack)
+/*
+ * Everything an ACK tells by its SACK blocks, in one pass over them:
+ *
+ * - the D-SACK, looked up on the blocks as received: the first block is
+ *   below snd_una or inside the second one (RFC 2883)
+ * - the blocks sorted by begin, without the ones ending inside an earlier
+ *   block; sack is rewritten with them
+ * - the bytes sacked above snd_una and the highest SACK edge
+ * - the hole between snd_una and the highest block, i.e. the reordering
+ */
+void process_sack(uint32_t snd_una, struct sack_block *sack, struct sack_info *info)
 {
-	int i, j;
+	memset(info, 0, sizeof(struct sack_info));
 	int num = sack->num;
 	if (num == 0)
-		return ;
+		return;
 
-	// sort sack blocks
-	for (i = num-1; i > 0; i--) {
-		for (j = 0; j < i; j++) {
-			if (after(SACK[j].begin, SACK[j+1].begin))
-				swap(SACK[j], SACK[j+1]);
-		}
+	if (before(SACK[0].begin, snd_una)) {
+		info->dsack_begin = SACK[0].begin;
+		info->dsack_end = MIN_SEQ(SACK[0].end, snd_una);
+	}
+	else if (num > 1 && !before(SACK[0].begin, SACK[1].begin) &&
+			!after(SACK[0].end, SACK[1].end)) {
+		info->dsack_begin = SACK[0].begin;
+		info->dsack_end = SACK[0].end;
 	}
 
-	// remove dup sacks
-	int valid = num;
-	for (i = 0, j = 1; i < num && j < num; i++, j++) {
-		while (j < num) {
-			if (!before(SACK[i].end, SACK[j].end)) {
-				j += 1;
-				valid -= 1;
-			}
-			else
-				break;
-		}
-		if (j < num && i+1 < j) {
-			// memcpy(&SACK[i+1], &SACK[j], sizeof(SACK[j]));
-			SACK[i+1] = SACK[j];
+	struct block_t sorted[4];
+	sort_blocks(snd_una, sack, num, sorted);
+
+	// the kept blocks have increasing ends, the last one is the highest
+	SACK[0] = sorted[0];
+	uint32_t bytes = sorted[0].end - sorted[0].begin;
+	int valid = 1, i = 1;
+	for (; i < num; i++) {
+		if (after(sorted[i].end, SACK[valid-1].end)) {
+			SACK[valid++] = sorted[i];
+			bytes += sorted[i].end - sorted[i].begin;
 		}
 	}
-
 	sack->num = valid;
-}
-
-/* calculate the number of bytes which are reordered. */
-int get_reordering(uint32_t snd_una, struct sack_block *sack, 
-		uint32_t *b, uint32_t *e) 
-{
-	if (sack->num == 0)
-		return 0;
-	else {
-		int last = sack->num - 1;
-		if (SACK[last].begin > snd_una) {
-			*b = snd_una;
-			*e = SACK[last].begin;
-			return *e - *b;
-		}
-		else
-			return 0;
+	info->max_ack = SACK[valid-1].end;
+
+	// the duplicate part of the sorted blocks is not counted
+	if (before(SACK[0].begin, snd_una))
+		bytes -= MIN_SEQ(SACK[0].end, snd_una) - SACK[0].begin;
+	else if (valid > 1 && SACK[0].begin == SACK[1].begin)
+		bytes -= SACK[0].end - SACK[0].begin;
+	info->sacked = bytes;
+
+	if (SACK[valid-1].begin > snd_una) {
+		info->reord_begin = snd_una;
+		info->reord_end = SACK[valid-1].begin;
 	}
 }
 
@@ -4,11 +4,17 @@
 #include "tcp_base.h"
 #include "list.h"
 
-uint32_t sacked(uint32_t snd_una, struct sack_block *sack);
-uint32_t max_sack_ack(struct sack_block *sack);
-int spurious_retrans(uint32_t snd_una, struct sack_block *sack, uint32_t *b, uint32_t *e);
-void normalize(struct sack_block *sack);
-int get_reordering(uint32_t snd_una, struct sack_block *sack, uint32_t *b , uint32_t *e);
+// see process_sack(), the ranges are empty if not found
+struct sack_info {
+	uint32_t sacked;
+	uint32_t max_ack;
+	uint32_t dsack_begin;
+	uint32_t dsack_end;
+	uint32_t reord_begin;
+	uint32_t reord_end;
+};
+
+void process_sack(uint32_t snd_una, struct sack_block *sack, struct sack_info *info);
 void add_to_block_list(struct sack_block *sack, struct list_head *list);
 
 #endif
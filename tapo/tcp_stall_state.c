@@ -2,9 +2,11 @@
 #include "tcp_state.h"
 #include "algorithm.h"
 
+#include <stdlib.h>
+
 void init_tcp_stall(struct tcp_state *ts, struct tcp_stall_state *tss, double duration, int dir, int len, uint32_t seq, double real_rto)
 {
-	tss->init_rwnd = ts->init_rwnd;
+	tss->init_rwnd = ts->cold->init_rwnd;
 	tss->max_snd_seg_size = ts->max_snd_seg_size;
 
 	tss->rwnd = ts->rwnd;
@@ -38,92 +40,84 @@ void init_tcp_stall(struct tcp_state *ts, struct tcp_stall_state *tss, double du
 	// tss->spurious = 0;
 }
 
-void fill_tcp_stall_list(struct tcp_state *ts, struct list_head *stall_list)
+static int cmp_seq(const void *a, const void *b)
 {
-	struct list_head *pos;
-	struct range_t *range;
-	struct tcp_stall_state *tss;
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return before(x, y) ? -1 : after(x, y) ? 1 : 0;
+}
 
-	int lost_num = 0, spurious_num = 0;
-	uint32_t *lost_array = NULL, *spurious_array = NULL;
-
-	list_for_each(pos, &ts->lost_list) 
-		lost_num += 1;
-	list_for_each(pos, &ts->spurious_retrans_list)
-		spurious_num += 1;
-
-	if (lost_num != 0) {
-		lost_array = MALLOC_N(uint32_t, lost_num);
-		int itr = 0;
-		list_for_each(pos, &ts->lost_list) {
-			range = list_entry(pos, struct range_t, list);
-			lost_array[itr++] = range->begin - ts->seq_base;
-		}
+// the begins of the ranges relative to base into array, sorted
+static void range_begins(const struct range_vec *rv, uint32_t base, uint32_t *array)
+{
+	int i, sorted = 1;
+	for (i = 0; i < rv->num; i++) {
+		array[i] = rv->range[i].begin - base;
+		if (i > 0 && before(array[i], array[i-1]))
+			sorted = 0;
 	}
 
-	if (spurious_num != 0) {
-		spurious_array = MALLOC_N(uint32_t, spurious_num);
-		int itr = 0;
-		list_for_each(pos, &ts->spurious_retrans_list) {
-			range = list_entry(pos, struct range_t, list);
-			spurious_array[itr++] = range->begin - ts->seq_base;
-		}
-	}
+	// the lost ranges are sorted already, the dsacks come in any order
+	if (!sorted)
+		qsort(array, rv->num, sizeof(uint32_t), cmp_seq);
+}
 
+// fr->begins has room for the begins of fr->lost and fr->spurious
+void fill_tcp_stall_list(struct tcp_state *ts, struct list_head *stall_list, struct flow_ranges *fr)
+{
+	struct list_head *pos;
+	struct tcp_stall_state *tss;
+
+	int lost_num = fr->lost.num, spurious_num = fr->spurious.num;
+	uint32_t *lost_array = fr->begins, *spurious_array = fr->begins + lost_num;
+	range_begins(&fr->lost, ts->seq_base, lost_array);
+	range_begins(&fr->spurious, ts->seq_base, spurious_array);
+
+	// snd_una and snd_nxt of the stalls mostly go up, their windows are swept
+	int lost_una = 0, lost_nxt = 0, spurious_una = 0, spurious_nxt = 0;
 	list_for_each(pos, stall_list) {
 		tss = list_entry(pos, struct tcp_stall_state, list); 
-		tss->lost = array_range(lost_array, lost_num, tss->snd_una, tss->snd_nxt);
-		tss->spurious = array_range(spurious_array, spurious_num, tss->snd_una, tss->snd_nxt);
+		lost_una = next_left_bound(lost_array, lost_num, lost_una, tss->snd_una);
+		lost_nxt = next_left_bound(lost_array, lost_num, lost_nxt, tss->snd_nxt);
+		spurious_una = next_left_bound(spurious_array, spurious_num, spurious_una, tss->snd_una);
+		spurious_nxt = next_left_bound(spurious_array, spurious_num, spurious_nxt, tss->snd_nxt);
+		tss->lost = lost_nxt - lost_una;
+		tss->spurious = spurious_nxt - spurious_una;
 		tss->flow_size = ts->flow_size;
 
-		int i = 0;
-		tss->cur_pkt_spurious_num = 0;
-		tss->cur_pkt_lost_num = 0;
-		for(i=0; i<spurious_num; i++){
-			if(tss->cur_pkt_seq == spurious_array[i])
-				tss->cur_pkt_spurious_num +=1;
-		}
-		for(i=0; i<lost_num; i++){
-			if(tss->cur_pkt_seq == lost_array[i])
-				tss->cur_pkt_lost_num +=1;
-		}
+		tss->cur_pkt_spurious_num = array_count(spurious_array, spurious_num, tss->cur_pkt_seq);
+		tss->cur_pkt_lost_num = array_count(lost_array, lost_num, tss->cur_pkt_seq);
 	}
-
-	if (lost_num != 0)
-		FREE(lost_array);
-	if (spurious_num != 0)
-		FREE(spurious_array);
 }
 
-void dump_tss_info(FILE *fp, struct tcp_stall_state *tss)
+void dump_tss_info(struct out_stream *out, struct tcp_stall_state *tss)
 {
-	fprintf(fp, "init_rwnd %d ", tss->init_rwnd);
-	fprintf(fp, "max_snd_seg_size %d ", tss->max_snd_seg_size);
-	fprintf(fp, "rwnd %d ", tss->rwnd);
-	fprintf(fp, "ca_state %s ", tcp_ca_state[tss->ca_state]);
-	//fprintf(fp, "cur_time %.6lf ", tss->cur_time);
-	fprintf(fp, "duration %.6lf ", tss->duration);
-	fprintf(fp, "rto %.3lf ", tss->rto);
-	fprintf(fp, "srtt %.6lf ", tss->srtt);
-	//fprintf(fp, "real_rto %.6lf ", tss->real_rto);
-	fprintf(fp, "snd_una %d ", tss->snd_una);
-	fprintf(fp, "snd_nxt %d ", tss->snd_nxt);
-
-	fprintf(fp, "packets_out %u ", tss->packets_out);
-	fprintf(fp, "sacked_out %u ", tss->sacked_out);
-	fprintf(fp, "holes %u ", tss->holes);
-	fprintf(fp, "outstanding %u ", tss->outstanding);
-	fprintf(fp, "lost %u ", tss->lost);
-	fprintf(fp, "spurious %u ", tss->spurious);
-
-	fprintf(fp, "head %u ", tss->head);
-	fprintf(fp, "cur_pkt_dir %u ", tss->cur_pkt_dir);
-	fprintf(fp, "cur_pkt_len %u ", tss->cur_pkt_len);
-	fprintf(fp, "cur_pkt_seq %u ", tss->cur_pkt_seq);
-	fprintf(fp, "last_pkt_dir %u ", tss->last_pkt_dir);
-	fprintf(fp, "cur_pkt_spurious_num %u ", tss->cur_pkt_spurious_num);
-	fprintf(fp, "cur_pkt_lost_num %u ", tss->cur_pkt_lost_num);
-	fprintf(fp, "tail %d  ", tss->tail);
-	fprintf(fp, "flow_size %d \n", tss->flow_size);
-	//fprintf(fp, "first_send_out_time = %.6lf \n ", tss->first_send_out_time);
+	out_printf(out, "init_rwnd %d ", tss->init_rwnd);
+	out_printf(out, "max_snd_seg_size %d ", tss->max_snd_seg_size);
+	out_printf(out, "rwnd %d ", tss->rwnd);
+	out_printf(out, "ca_state %s ", tcp_ca_state[tss->ca_state]);
+	//out_printf(out, "cur_time %.6lf ", tss->cur_time);
+	out_printf(out, "duration %.6lf ", tss->duration);
+	out_printf(out, "rto %.3lf ", tss->rto);
+	out_printf(out, "srtt %.6lf ", tss->srtt);
+	//out_printf(out, "real_rto %.6lf ", tss->real_rto);
+	out_printf(out, "snd_una %d ", tss->snd_una);
+	out_printf(out, "snd_nxt %d ", tss->snd_nxt);
+
+	out_printf(out, "packets_out %u ", tss->packets_out);
+	out_printf(out, "sacked_out %u ", tss->sacked_out);
+	out_printf(out, "holes %u ", tss->holes);
+	out_printf(out, "outstanding %u ", tss->outstanding);
+	out_printf(out, "lost %u ", tss->lost);
+	out_printf(out, "spurious %u ", tss->spurious);
+
+	out_printf(out, "head %u ", tss->head);
+	out_printf(out, "cur_pkt_dir %u ", tss->cur_pkt_dir);
+	out_printf(out, "cur_pkt_len %u ", tss->cur_pkt_len);
+	out_printf(out, "cur_pkt_seq %u ", tss->cur_pkt_seq);
+	out_printf(out, "last_pkt_dir %u ", tss->last_pkt_dir);
+	out_printf(out, "cur_pkt_spurious_num %u ", tss->cur_pkt_spurious_num);
+	out_printf(out, "cur_pkt_lost_num %u ", tss->cur_pkt_lost_num);
+	out_printf(out, "tail %d  ", tss->tail);
+	out_printf(out, "flow_size %d \n", tss->flow_size);
+	//out_printf(out, "first_send_out_time = %.6lf \n ", tss->first_send_out_time);
 }
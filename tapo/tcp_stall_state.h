@@ -3,9 +3,10 @@
 
 #include "tcp_base.h"
 #include "list.h"
-#include <stdio.h>
+#include "output.h"
 
 struct tcp_state;
+struct flow_ranges;
 
 struct tcp_stall_state {
 	int init_rwnd;
@@ -45,7 +46,7 @@ struct tcp_stall_state {
 };
 
 void init_tcp_stall(struct tcp_state *ts, struct tcp_stall_state *tss, double duration, int dir, int len, uint32_t seq, double real_rto);
-void fill_tcp_stall_list(struct tcp_state *ts, struct list_head *stall_list);
-void dump_tss_info(FILE *fp, struct tcp_stall_state *tss);
+void fill_tcp_stall_list(struct tcp_state *ts, struct list_head *stall_list, struct flow_ranges *fr);
+void dump_tss_info(struct out_stream *out, struct tcp_stall_state *tss);
 
 #endif
@@ -4,191 +4,249 @@
 #include "malloc.h"
 #include "tcp_sack.h"
 #include "tcp_stall_state.h"
-#include "rule_parser.h"
+#include "rule_engine.h"
 #include "log.h"
 #include "def.h"
 #include "cmd_options.h"
+#include "output.h"
+#include "series_bin.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stdlib.h>
+#include <assert.h>
 
 const char *tcp_ca_state[] = { "TCP_CA_OPEN", "TCP_CA_RECOVERY" };
 
+__thread struct out_stream *series_out = NULL;
+__thread struct out_stream *report_out = NULL;
+__thread struct out_stream *snapshot_out = NULL;
+__thread void (*report_hook)(struct tcp_state *ts) = NULL;
+
 // valid state: TCP_CLOSE, TCP_SYN_RECV, TCP_SYN_SENT, TCP_ESTABLISHED, TCP_FIN_WAIT1, TCP_FIN_WAIT2 }
 // 				TCP_LISTEN
 
-struct tcp_state *new_tcp_state(struct tcp_key *key, double time)
+struct tcp_state *new_tcp_state(struct tcp_key *key, nstime_t time)
 {
 	struct tcp_state *ts = MALLOC(struct tcp_state);
+	struct tcp_state_cold *cold = MALLOC(struct tcp_state_cold);
 
 	// all the variables have been set to 0
 
 	memcpy(&ts->key, key, sizeof(struct tcp_key));
-	sprintf(ts->name, "%s.%hu", inet_ntoa(key->addr[1]), ntohs(key->port[1]));
+	ts->cold = cold;
 	ts->rwnd_scale = 1;
 	ts->state = TCP_LISTEN;
-	ts->file_num = 0;
 	ts->tail_burst = 0;
+	ts->last_snapshot_time = time;
+	if (series_file != NULL && (output_kinds & OUT_SERIES))
+		ts->flow_id = series_new_flow(key);
 
 	init_rtt(&ts->rtt);
 
-	init_list_head(&ts->rtt_list);
-	init_list_head(&ts->block_list);
-	init_list_head(&ts->retrans_list);
-	init_list_head(&ts->reordering_list);
-	init_list_head(&ts->spurious_retrans_list);
-	init_list_head(&ts->lost_list);
-	init_list_head(&ts->send_out_time_list);
-	init_list_head(&ts->srtt_list);
-
-	init_list_head(&ts->stall_list);
+	init_list_head(&cold->block_list);
+	init_list_head(&cold->reordering_list);
+	init_list_head(&cold->spurious_retrans_list);
+	init_list_head(&cold->stall_list);
 
 	return ts;
 }
 
+// the client end, e.g. "10.1.2.3.40000"
+const char *flow_name(struct tcp_state *ts)
+{
+	struct tcp_state_cold *cold = ts->cold;
+	if (cold->name[0] == '\0') {
+		char addr[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &ts->key.addr[1], addr, sizeof(addr));
+		snprintf(cold->name, sizeof(cold->name), "%s.%hu", addr, ntohs(ts->key.port[1]));
+	}
+
+	return cold->name;
+}
+
 static void update_reordering(struct tcp_state *ts, uint32_t b, uint32_t e)
 {
-	if (ts->reord.begin == 0) {
-		ts->reord.begin = b;
-		ts->reord.end = e;
+	struct tcp_state_cold *cold = ts->cold;
+	if (cold->reord.begin == 0) {
+		cold->reord.begin = b;
+		cold->reord.end = e;
 	}
 	else {
-		if (after(b, ts->reord.end)) {
-			append_to_range_list(&ts->reordering_list, 
-					ts->reord.begin, ts->reord.end); 
-			ts->reord.begin = b;
-			ts->reord.end = e;
+		if (after(b, cold->reord.end)) {
+			append_to_range_list(&cold->reordering_list, 
+					cold->reord.begin, cold->reord.end); 
+			cold->reord.begin = b;
+			cold->reord.end = e;
 		}
-		else if (after(ts->reord.begin, e)) {
+		else if (after(cold->reord.begin, e)) {
 			LOG(DEBUG, "invalid reordering range.\n");
 		}
 		else {
-			if (before(b, ts->reord.begin))
-				ts->reord.begin = b;
-			if (after(e, ts->reord.end))
-				ts->reord.end = e;
+			if (before(b, cold->reord.begin))
+				cold->reord.begin = b;
+			if (after(e, cold->reord.end))
+				cold->reord.end = e;
 		}
 	}
 }
 
-// this function should be called when sweeping the flow
-static void get_lost_list(struct tcp_state *ts)
+static __thread struct flow_ranges *franges = NULL;
+
+// the flow_ranges of the calling thread, with room for the lists of ts
+static struct flow_ranges *get_flow_ranges(struct tcp_state *ts)
 {
-	struct list_head *retrans = &ts->retrans_list, 
-					 *spurious_retrans = &ts->spurious_retrans_list, 
-					 *lost = &ts->lost_list;
-
-	struct list_head *xp = retrans->next, 
-					 *rp = spurious_retrans->next;
-	struct range_t *xr, *rr;
-	while (xp != retrans && rp != spurious_retrans) {
-		xr = list_entry(xp, struct range_t, list);
-		rr = list_entry(rp, struct range_t, list);
-
-		if (before(xr->begin, rr->begin)) {
-			// xr is lost
-			append_to_range_list(lost, xr->begin, xr->end);
-			xp = xp->next;
-		}
-		else if (!before(xr->begin, rr->end)) {
-			rp = rp->next;
-		}
-		else {
-			xp = xp->next;
-		}
-	}
+	struct tcp_state_cold *cold = ts->cold;
+	struct flow_ranges *fr = franges;
+	if (fr == NULL)
+		fr = franges = MALLOC_N(struct flow_ranges, 1);
+
+	list_to_range_vec(&cold->block_list, &fr->block);
+	list_to_range_vec(&cold->reordering_list, &fr->reord);
+	list_to_range_vec(&cold->spurious_retrans_list, &fr->spurious);
+	// every retransmission is lost at most once, and splits a reordering
+	// range at most once
+	reserve_range_vec(&fr->lost, ts->retrans_list.num);
+	reserve_range_vec(&fr->reord, fr->reord.num + ts->retrans_list.num);
+
+	int n = ts->retrans_list.num + fr->spurious.num;
+	if (n > fr->begin_cap) {
+		fr->begin_cap = MAX(n, fr->begin_cap*2);
+		fr->begins = realloc(fr->begins, fr->begin_cap*sizeof(uint32_t));
+		assert(fr->begins != NULL);
+	}
+
+	return fr;
+}
 
-	while (xp != retrans) {
-		xr = list_entry(xp, struct range_t, list);
-		append_to_range_list(lost, xr->begin, xr->end);
-		xp = xp->next;
-	}
+void tcp_state_thread_cleanup()
+{
+	if (franges == NULL)
+		return;
+
+	delete_range_vec(&franges->block);
+	delete_range_vec(&franges->reord);
+	delete_range_vec(&franges->spurious);
+	delete_range_vec(&franges->lost);
+	free(franges->begins);
+	FREE_N(franges);
+	franges = NULL;
 }
 
-static void get_reord_list(struct tcp_state *ts)
+// this function should be called when sweeping the flow
+static void get_lost_list(struct tcp_state *ts, struct flow_ranges *fr)
 {
-	struct list_head *reord_node = ts->reordering_list.next,
-					 *lost_node = ts->lost_list.next,
-					 *block_node = ts->block_list.next;
-	struct range_t *reord, *lost, *block;
-	while (reord_node != &ts->reordering_list && 
-			lost_node != &ts->lost_list) {
-		reord = list_entry(reord_node, struct range_t, list);
-		lost = list_entry(lost_node, struct range_t, list);
-
-		if (!after(reord->end, lost->begin))
-			reord_node = reord_node->next;
-		else if (!after(lost->end, reord->begin))
-			lost_node = lost_node->next;
-		else {
-			if (after(lost->begin, reord->begin)) {
-				// lost does not cover the front part of reord
-				struct range_t *new = MALLOC(struct range_t);
-				new->begin = reord->begin;
-				new->end = lost->begin;
-				list_insert(&new->list, reord_node->prev, reord_node);
-			}
+	struct range_array *retrans = &ts->retrans_list;
+	struct block_t *spurious = fr->spurious.range, *lost = fr->lost.range;
+	int xi = 0, si = 0, n = 0;
+
+	// the retransmissions not covered by a dsack are lost
+	while (xi < retrans->num && si < fr->spurious.num) {
+		struct block_t *xr = &retrans->range[xi], *sr = &spurious[si];
+		if (before(xr->begin, sr->begin))
+			lost[n++] = retrans->range[xi++];
+		else if (!before(xr->begin, sr->end))
+			si += 1;
+		else
+			xi += 1;
+	}
+
+	memcpy(&lost[n], &retrans->range[xi], (retrans->num - xi)*sizeof(struct block_t));
+	fr->lost.num = n + retrans->num - xi;
+}
 
-			if (before(lost->end, reord->end)) {
-				// lost does not cover the tail part of reord
-				struct range_t *new = MALLOC(struct range_t);
-				new->begin = lost->end;
-				new->end = reord->end;
-				list_insert(&new->list, reord_node, reord_node->next);
-			}
+/*
+ * Removes the lost ranges and the sacked blocks from the reordering
+ * ranges. A lost range splits a reordering range into a front part, which
+ * is final, and a tail part, which is merged further, so there are at most
+ * reord.num + lost.num parts. The reordering ranges are moved up by
+ * lost.num first, then the parts written from the start never overtake
+ * the ranges still to be read.
+ */
+static void get_reord_list(struct tcp_state *ts, struct flow_ranges *fr)
+{
+	int rn = fr->reord.num, ln = fr->lost.num, bn = fr->block.num;
+	struct block_t *out = fr->reord.range, *in = out + ln,
+				   *lost = fr->lost.range, *block = fr->block.range;
+	memmove(in, out, rn*sizeof(struct block_t));
+
+	struct block_t r;
+	int ri = 0, li = 0, n = 0, cur = 0; // cur: r is read, maybe a tail part
+	while ((cur || ri < rn) && li < ln) {
+		if (!cur) {
+			r = in[ri++];
+			cur = 1;
+		}
 
-			// delete the reord node
-			reord_node = reord_node->next;
-			list_delete_entry(reord_node->prev);
-			FREE(reord);
+		if (!after(r.end, lost[li].begin)) {
+			out[n++] = r;
+			cur = 0;
+		}
+		else if (!after(lost[li].end, r.begin)) {
+			li += 1;
+		}
+		else {
+			if (after(lost[li].begin, r.begin)) {
+				// lost does not cover the front part of r
+				out[n].begin = r.begin;
+				out[n++].end = lost[li].begin;
+			}
 
-			lost_node = lost_node->next;
+			if (before(lost[li].end, r.end))
+				// lost does not cover the tail part of r
+				r.begin = lost[li].end;
+			else
+				cur = 0;
+			li += 1;
 		}
 	}
-
-	reord_node = ts->reordering_list.next;
-	block_node = ts->block_list.next;
-	while (reord_node != &ts->reordering_list && 
-			block_node != &ts->block_list) {
-		reord = list_entry(reord_node, struct range_t, list);
-		block = list_entry(block_node, struct range_t, list);
-		if (after(block->begin, reord->end)) {
-			reord_node = reord_node->next;
+	if (cur)
+		out[n++] = r;
+	memmove(&out[n], &in[ri], (rn - ri)*sizeof(struct block_t));
+	n += rn - ri;
+
+	// trim by the sacked blocks, the short ones are dropped in place
+	int w = 0, bi = 0;
+	ri = 0;
+	while (ri < n && bi < bn) {
+		struct block_t *rr = &out[ri], *b = &block[bi];
+		if (after(b->begin, rr->end)) {
+			out[w++] = out[ri++];
 			continue;
 		}
 
-		if (after(reord->begin, block->end)) {
-			block_node = block_node->next;
+		if (after(rr->begin, b->end)) {
+			bi += 1;
 			continue;
 		}
 
-		if (!after(block->begin, reord->begin)) {
-			reord->begin = block->end;			
-		}
-		if (!before(block->end, reord->end)) {
-			reord->end = block->begin;
-		}
+		if (!after(b->begin, rr->begin))
+			rr->begin = b->end;
+		if (!before(b->end, rr->end))
+			rr->end = b->begin;
 
-		reord_node = reord_node->next;
-		if ((int)(reord->end - reord->begin) <= (int)(ts->max_snd_seg_size)) {
-			list_delete_entry(reord_node->prev);
-			FREE(reord);
-		}
+		ri += 1;
+		if ((int)(rr->end - rr->begin) > (int)(ts->max_snd_seg_size))
+			out[w++] = *rr;
 	}
+	memmove(&out[w], &out[ri], (n - ri)*sizeof(struct block_t));
+	fr->reord.num = w + n - ri;
 }
 
-static void handle_in_pkt(struct tcp_state *ts, struct tcphdr *th, double time, int len)
+static void handle_in_pkt(struct tcp_state *ts, struct tcp_option *opt,
+		struct tcphdr *th, nstime_t time, int len)
 {
 	uint32_t seq = ntohl(th->seq),
 			 ack_seq = ntohl(th->ack_seq);
+	uint32_t prev_una = ts->snd_una;
 	if (IS_SYN(th)) {
-		ts->rwnd_scale = (1 << ts->option.wscale);
-		ts->init_rwnd = ntohs(th->window) * ts->rwnd_scale;
+		ts->rwnd_scale = IS_FLAG_SET(opt, TCPOPT_WSCALE) ? (1 << opt->wscale) : 1;
+		ts->cold->init_rwnd = ntohs(th->window) * ts->rwnd_scale;
 	}
-	if ((ts->snd_nxt != 0) && (file_type == UPLOAD))
- 		printf("inflight_size %d time  %f\n", (ts->snd_nxt - ack_seq), time - ts->start_time);
+	if ((ts->snd_nxt != 0) && (file_type == UPLOAD) && (output_kinds & OUT_SERIES) && series_file == NULL)
+ 		out_printf(OUTPUT_STREAM(series_out), "inflight_size %d time  %f\n", (ts->snd_nxt - ack_seq), NS_TO_SEC(time - ts->start_time));
 	ts->rwnd = ntohs(th->window) * ts->rwnd_scale;
 	//printf("rwnd %d\n", ts->rwnd);
 	ts->in_data_size = ts->in_data_size + len;
@@ -199,28 +257,36 @@ static void handle_in_pkt(struct tcp_state *ts, struct tcphdr *th, double time,
 	if (IS_SYN(th) || IS_FIN(th))
 		ts->rcv_una += 1;
 
-	struct sack_block *cur_sack = &ts->option.sack;
+	struct sack_block *cur_sack = &opt->sack;
+	struct sack_info si;
+	process_sack(ts->snd_una, cur_sack, &si);
 	if (cur_sack->num != 0) {
-		int l;
-		uint32_t b, e;
 		// find spurious retrans
-		l = spurious_retrans(ts->snd_una, cur_sack, &b, &e);
-		if (l != 0) 
-			append_to_range_list(&ts->spurious_retrans_list, b, e);
-
-		normalize(cur_sack);
+		if (si.dsack_end != si.dsack_begin)
+			append_to_range_list(&ts->cold->spurious_retrans_list, si.dsack_begin, si.dsack_end);
 
 		// Find reordering, no matter whether it's in recovery mode. We can
 		// remove the real lost when finishing the flow.
-		l = get_reordering(ts->snd_una, cur_sack, &b, &e);
-		if (l != 0) 
-			update_reordering(ts, b, e);
+		if (si.reord_end != si.reord_begin)
+			update_reordering(ts, si.reord_begin, si.reord_end);
 
-		add_to_block_list(cur_sack, &ts->block_list);
+		add_to_block_list(cur_sack, &ts->cold->block_list);
 	}
 
 	memcpy(&ts->sack, cur_sack, sizeof(struct sack_block));
 
+	// snd_una and the sack only change here
+	ts->sacked_out = si.sacked;
+	if (ts->sacked_out > 0) 
+		ts->holes = si.max_ack - ts->snd_una - ts->sacked_out;
+	else
+		ts->holes = 0;
+
+	if (ts->sack.num > 0) 
+		ts->fackets_out = si.max_ack - ts->snd_una;
+	else 
+		ts->fackets_out = 0;
+
 	if (ts->ca_state == TCP_CA_RECOVERY) {
 		if (ack_seq > ts->recovery_point || 
 				(ack_seq == ts->recovery_point && cur_sack->num == 0)) {
@@ -228,30 +294,46 @@ static void handle_in_pkt(struct tcp_state *ts, struct tcphdr *th, double time,
 			ts->ca_state = TCP_CA_OPEN;
 		}
 	}
-	else {
+	else if (!ts->rtt_ts) {
 		int rtt = get_rtt(ack_seq, time, &ts->rtt_list);
-		if (rtt != 0){
+		if (rtt != 0)
 			update_rtt(&ts->rtt, rtt);
-			double srtt_temp = ts->rtt.srtt >> 3;
-			append_to_range_list(&ts->srtt_list, srtt_temp, 0);
-		}
 	}
+
+	// Every ACK of new data echoing a TSval is a sample, in recovery too.
+	// The first echo of a TSval drops it, the later ones would include the
+	// time the receiver held the following segments.
+	if (ts->rtt_ts && IS_FLAG_SET(opt, TCPOPT_TIMESTAMP) &&
+			(prev_una == 0 || after(ack_seq, prev_una))) {
+		uint32_t tsecr = opt->ts.tv_usec;
+		int rtt = get_rtt(tsecr, time, &ts->rtt_list);
+		if (rtt != 0)
+			update_rtt(&ts->rtt, rtt);
+		truncate_rtt_ring(&ts->rtt_list, tsecr);
+	}
+
+	// samples of acknowledged segments are never matched again
+	if (!ts->rtt_ts)
+		truncate_rtt_ring(&ts->rtt_list, ts->snd_una);
+	truncate_rtt_ring(&ts->send_out_time_list, ts->snd_una);
 }
 
-static void handle_out_pkt(struct tcp_state *ts, struct tcphdr *th, double time, int len)
+static void handle_out_pkt(struct tcp_state *ts, struct tcp_option *opt,
+		struct tcphdr *th, nstime_t time, int len)
 {
 	uint32_t seq = ntohl(th->seq),
 			 ack_seq = ntohl(th->ack_seq);
 	if (ts->seq_base == 0)
 		ts->seq_base = seq;
 	ts->pkt_out_cnt += 1;
-	printf("seq %d time %f\n", seq - ts->seq_base, time - ts->start_time);
+	if ((output_kinds & OUT_SERIES) && series_file == NULL)
+		out_printf(OUTPUT_STREAM(series_out), "seq %d time %f\n", seq - ts->seq_base, NS_TO_SEC(time - ts->start_time));
 	if (seq < ts->snd_nxt) {
 		ts->retrans_temp +=1;
 		ts->ca_state = TCP_CA_RECOVERY;
 		ts->recovery_point = ts->snd_nxt;
 		if (len > 0)
-			append_to_range_list(&ts->retrans_list, seq, seq+len);
+			append_to_range_array(&ts->retrans_list, seq, seq+len);
 	}
 	else {
 		// MAX can not distinguish number 7 and -9
@@ -289,6 +371,15 @@ static void handle_out_pkt(struct tcp_state *ts, struct tcphdr *th, double time,
 
 	ts->rcv_nxt = ack_seq;
 
+	if (rtt_source == RTT_TS && IS_FLAG_SET(opt, TCPOPT_TIMESTAMP)) {
+		if (!ts->rtt_ts) {
+			// the samples taken so far are keyed by sequence numbers
+			ts->rtt_list.num = 0;
+			ts->rtt_ts = 1;
+		}
+		insert_ts_rtt(opt->ts.tv_sec, time, &ts->rtt_list);
+	}
+
 	if (ts->ca_state == TCP_CA_RECOVERY) {
 		if (seq < ts->recovery_point) {
 			//if (len > 0)
@@ -298,7 +389,7 @@ static void handle_out_pkt(struct tcp_state *ts, struct tcphdr *th, double time,
 			ts->ca_state = TCP_CA_OPEN;
 		}
 	}
-	else {
+	else if (!ts->rtt_ts) {
 		uint32_t seq_una = seq + len;
 		// we do not consider other flags like URG.
 		if (IS_SYN(th) || IS_FIN(th))
@@ -308,8 +399,20 @@ static void handle_out_pkt(struct tcp_state *ts, struct tcphdr *th, double time,
 	
 }
 
-int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double cap_time, int dir)
+// a row of the binary series
+static void add_series_row(struct tcp_state *ts, struct tcphdr *th, nstime_t time, int dir)
+{
+	uint32_t seq = (dir == DIR_OUT) ? ntohl(th->seq) : ntohl(th->ack_seq);
+	int64_t time_ns = time - ts->start_time;
+	// nothing is acked before the handshake finishes
+	int32_t inflight = (ts->snd_nxt != 0 && ts->snd_una != 0) ? ts->snd_nxt - ts->snd_una : 0;
+	series_add(ts->flow_id, time_ns, seq - ts->seq_base, inflight, ts->rwnd, dir);
+}
+
+static int __tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, nstime_t cap_time, int dir)
 {
+	struct tcp_state_cold *cold = ts->cold;
+	struct tcp_option opt;
 	uint32_t seq = ntohl(th->seq);
 	uint32_t ack_seq = ntohl(th->ack_seq);
 	
@@ -318,7 +421,7 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 		ts->head=1;
 
 	//set the tail burst
-	if((ts->last_pkt_dir == DIR_OUT)&&((cap_time-ts->last_time)<0.0005)&&(seq>=ts->snd_nxt))
+	if((ts->last_pkt_dir == DIR_OUT)&&((cap_time-ts->last_time)<500*NSEC_PER_USEC)&&(seq>=ts->snd_nxt))
 		ts->tail_burst +=1;
 	else
 	{
@@ -334,7 +437,7 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 	
 		ts->start_time = cap_time;
 		ts->last_time = cap_time;
-		ts->last_stall_time = cap_time;
+		cold->last_stall_time = cap_time;
 	}
 	else if (IS_RST(th)) {
 		// both can drop the connection by RST
@@ -352,7 +455,7 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 
 					//ts->seq_base = seq;
 					//printf("initial seq number is: %d\n", seq);
-					ts->last_stall_point = ts->seq_base;
+					cold->last_stall_point = ts->seq_base;
 				}
 				break;
 			case TCP_SYN_SENT:
@@ -372,15 +475,15 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 				}
 				break;
 			case TCP_FIN_WAIT1:
-				if ((cap_time - ts->last_time)>5)
-					ts->reset = 1;
+				if ((cap_time - ts->last_time)>5*NSEC_PER_SEC)
+					cold->reset = 1;
 
 				if (dir == DIR_OUT && ack_seq == ts->rcv_una)
 					ts->state = TCP_CLOSE;
 				break;
 			case TCP_FIN_WAIT2:
-				if ((cap_time - ts->last_time)>5)
-					ts->reset = 1;
+				if ((cap_time - ts->last_time)>5*NSEC_PER_SEC)
+					cold->reset = 1;
 				if (dir == DIR_IN && ack_seq == ts->snd_nxt)
 					ts->state = TCP_CLOSE;
 				break;
@@ -398,15 +501,14 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 
 	int thres = rtt_thres(&ts->rtt);
 	//double thres = 0.000001;	
-	// check whether there is a stall
-	//double  duration = 0.0;
-	int duration = 0;
+	// check whether there is a stall, in ticks
+	int64_t duration = 0;
 	if (dir == DIR_IN && IS_SYN(th)) {
 		ts->start_time = cap_time;
 	}
-	else {
-		duration = TIME_TO_TICK(cap_time - ts->last_time);
-		//duration = cap_time - ts->last_time;
+	else if (ts->last_time != 0) {
+		// not the first packet of a flow caught without its handshake
+		duration = NS_TO_TICK(cap_time - ts->last_time);
 	}
 	if (duration > thres) {
 		// store the (partial) stall state in list
@@ -421,43 +523,35 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 
 		struct tcp_stall_state *tss = MALLOC(struct tcp_stall_state);
 		init_tcp_stall(ts, tss, TICK_TO_TIME(duration),dir,len,seq, TICK_TO_TIME(real_RTO));
-		list_insert(&tss->list, ts->stall_list.prev, &ts->stall_list);
+		list_insert(&tss->list, cold->stall_list.prev, &cold->stall_list);
 
 		// finally, update the following info
-		ts->last_stall_point = ts->snd_una;
-		ts->last_stall_time = cap_time;
+		cold->last_stall_point = ts->snd_una;
+		cold->last_stall_time = cap_time;
 	}
 
 	// parse tcp options
-	get_tcp_option(th, &ts->option);
+	get_tcp_option(th, &opt);
 
 	if (dir == DIR_OUT) {
-		handle_out_pkt(ts, th, cap_time, len);
+		handle_out_pkt(ts, &opt, th, cap_time, len);
 	}
 	else {
-		handle_in_pkt(ts, th, cap_time, len);
+		handle_in_pkt(ts, &opt, th, cap_time, len);
 	}
 
+	if (series_file != NULL && (output_kinds & OUT_SERIES))
+		add_series_row(ts, th, cap_time, dir);
+
 	/* use bytes as the metrics */
 	ts->packets_out = ts->snd_nxt - ts->snd_una;
-	ts->sacked_out = sacked(ts->snd_una, &ts->sack);
-	if (ts->sacked_out > 0) 
-		ts->holes = max_sack_ack(&ts->sack) - ts->snd_una - ts->sacked_out;
-	else
-		ts->holes = 0;
-
-	if (ts->sack.num > 0) 
-		ts->fackets_out = max_sack_ack(&ts->sack) - ts->snd_una;
-	else 
-		ts->fackets_out = 0;
-
-	ts->retrans_out = list_range_size(&ts->retrans_list, ts->snd_una, ts->snd_nxt);
+	ts->retrans_out = range_array_size(&ts->retrans_list, ts->snd_una, ts->snd_nxt);
 	ts->outstanding = ts->packets_out - ts->sacked_out + ts->retrans_out;
 
-	if ((duration > thres)&&(ts->this_transfer_begin_time != 0)) {
-		ts->total_duration +=TICK_TO_TIME(duration);
+	if ((duration > thres)&&(cold->this_transfer_begin_time != 0)) {
+		cold->total_duration += duration*NSEC_PER_USEC;
 		if ((ts->state == TCP_ESTABLISHED) && (seq < (ts->snd_nxt-len)) &&(dir == DIR_OUT)) {
-			ts->retrans_duration +=TICK_TO_TIME(duration);
+			cold->retrans_duration += duration*NSEC_PER_USEC;
 		}
 	}
 	
@@ -466,11 +560,11 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 		ts->head=0;
 	if(dir == DIR_IN && len>1)
 	{
-		ts->file_num +=1;
-		if( ts->this_transfer_begin_time != 0)	
-			ts->total_transfer_time += ts->last_in_time - ts->this_transfer_begin_time;
+		cold->file_num +=1;
+		if( cold->this_transfer_begin_time != 0)	
+			cold->total_transfer_time += ts->last_in_time - cold->this_transfer_begin_time;
 		
-		ts->this_transfer_begin_time = cap_time;
+		cold->this_transfer_begin_time = cap_time;
 	}
 	
 
@@ -487,109 +581,117 @@ int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double c
 	return 0;
 }
 
-static inline void dump_list(FILE *fp, const char *fmt, \
-		struct tcp_state *ts, struct list_head *list, int *num)
+static void dump_snapshot(struct out_stream *out, struct tcp_state *ts, nstime_t time)
 {
-	struct list_head *p;
-	//struct range_t *r;
-	//fprintf(fp, fmt);
-	list_for_each(p, list) {
-		(*num) +=1;
-		//r = list_entry(p, struct range_t, list);
-		/*
-		fprintf(fp, " (%d,%d,%d)", 
-				(r->begin - ts->seq_base), 
-				(r->end - ts->seq_base),
-				DIV_CEIL(r->end - r->begin, ts->max_snd_seg_size));
-	*/
-	}
-	//fprintf(fp, "\n");
+	out_printf(out, "snapshot %s time %f state %d ca_state %s snd_una %u snd_nxt %u "
+			"packets_out %d sacked_out %d retrans_out %d rwnd %d srtt_us %u stalls %u\n",
+			flow_name(ts), NS_TO_SEC(time - ts->start_time), ts->state, tcp_ca_state[ts->ca_state],
+			ts->snd_una - ts->seq_base, ts->snd_nxt - ts->seq_base,
+			ts->packets_out, ts->sacked_out, ts->retrans_out, ts->rwnd,
+			ts->rtt.srtt >> 3, ts->stall_cnt);
 }
 
-static inline int dump_list_rtt(struct list_head *list)
+int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, nstime_t cap_time, int dir)
 {
-	struct list_head *p;
-	struct range_t *r;
-	int num=0;
-	int total_srtt=0, avg_srtt_temp=0;
-	list_for_each(p, list) {
-		num +=1;
-		r = list_entry(p, struct range_t, list);
-		total_srtt = total_srtt + r->begin;
-	}
-	if(num >= 1){
-		avg_srtt_temp = total_srtt/num;
-	}
-	return avg_srtt_temp;
+	struct mem_pool *prev = use_pool(&ts->cold->pool);
+	int ret = __tcp_state_machine(ts, th, len, cap_time, dir);
+	use_pool(prev);
+
+	// snapshots are taken by the packets of the flow, at most one per interval
+	if ((output_kinds & OUT_SNAPSHOT) &&
+			cap_time - ts->last_snapshot_time >= snapshot_interval) {
+		dump_snapshot(series_file != NULL ? OUTPUT_STREAM(snapshot_out) :
+				OUTPUT_STREAM(series_out), ts, cap_time);
+		ts->last_snapshot_time = cap_time;
+	}
+
+	return ret;
 }
 
-void dump_tss_list(FILE *fp, struct list_head *list)
+// a stall is classified by every rule set, its types in the order of --rules
+static void dump_tss_block(struct out_stream *out, struct tcp_stall_state **block, int n)
+{
+	int types[MAX_RULE_FILES][RULE_BLOCK], i, j;
+	for (j = 0; j < stall_rule_num; j++)
+		classify_stalls(stall_rules[j], block, n, types[j]);
+	count_stall_types(types, n);
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < stall_rule_num; j++) {
+			struct rule_set *rs = stall_rules[j];
+			out_printf(out, "%s: \"%s\" ", rs->type[types[j][i]], rs->detail[types[j][i]]);
+		}
+		dump_tss_info(out, block[i]);
+	}
+}
+
+static void dump_tss_list(struct out_stream *out, struct list_head *list)
 {
 	struct list_head *pos;
-	struct tcp_stall_state *tss;
+	struct tcp_stall_state *block[RULE_BLOCK];
+	int n = 0;
+	// the rules run over blocks of stalls
 	list_for_each(pos, list) {
-		tss = list_entry(pos, struct tcp_stall_state, list);
-		enum stall_type type = parse_stall(tss);
-		fprintf(fp, "%s: \"%s\" ", stall_text[type], stall_details[type]);
-		dump_tss_info(fp, tss);
+		block[n++] = list_entry(pos, struct tcp_stall_state, list);
+		if (n == RULE_BLOCK) {
+			dump_tss_block(out, block, n);
+			n = 0;
+		}
 	}
+	if (n > 0)
+		dump_tss_block(out, block, n);
 }
 
-void dump_ts_info(FILE *fp, struct tcp_state *ts)
+void dump_ts_info(struct out_stream *out, struct tcp_state *ts, struct flow_ranges *fr)
 {
-	int retrans_num = 0, reorder_num = 0, spurious_num = 0, lost_num =0;
+	struct tcp_state_cold *cold = ts->cold;
+	int lost_num = fr->lost.num;
 	double transfer_time;
-	transfer_time = (ts->total_transfer_time + (ts->last_in_time - ts->this_transfer_begin_time));
+	transfer_time = NS_TO_SEC(cold->total_transfer_time + (ts->last_in_time - cold->this_transfer_begin_time));
 
 	//calculate the reduce duration if use 2*RTT as RTO
 	
 	struct list_head *pos;
 	struct tcp_stall_state *tss;
-	struct list_head *list = &ts->stall_list;
-	ts->retrans_duration =0;
-	ts->pkt_delay_duration =0;
+	struct list_head *list = &cold->stall_list;
+	cold->retrans_duration =0;
+	cold->pkt_delay_duration =0;
 	list_for_each(pos, list) {
 		tss = list_entry(pos, struct tcp_stall_state, list);
 		if((tss->cur_pkt_spurious_num + tss->cur_pkt_lost_num) >= 1){
 			//if ((tss->real_rto - 2*tss->srtt)>0){
-				//ts->reduce_duration += tss->real_rto - 2*tss->srtt;
+				//cold->reduce_duration += tss->real_rto - 2*tss->srtt;
 			//}
-			//ts->retrans_duration += tss->real_rto;
+			//cold->retrans_duration += tss->real_rto;
 		}
 		if((tss->head != 1)&&(tss->cur_pkt_dir == 1)){
 			//if ((tss->duration -2*tss->srtt)>0){
-				ts->pkt_delay_duration += tss->duration -2*tss->srtt;
+				cold->pkt_delay_duration += tss->duration -2*tss->srtt;
 			//}
 		}
 	}
 
-	//double avg_srtt =TICK_TO_TIME(dump_list_rtt(&ts->srtt_list));
-
-	dump_list(fp, "retrans:", ts, &ts->retrans_list, &retrans_num);
-	dump_list(fp, "reorder:", ts, &ts->reordering_list, &reorder_num);
-	dump_list(fp, "spurious:", ts, &ts->spurious_retrans_list, &spurious_num);
-	dump_list(fp, "lost:", ts, &ts->lost_list, &lost_num);
 	//fprintf(fp, "lost_num %d ", lost_num);
-	//fprintf(fp, "retrans_num %d ", retrans_num);
+	//fprintf(fp, "retrans_num %d ", ts->retrans_list.num);
 	//fprintf(fp, "retrans_temp: %d ", ts->retrans_temp);
 	//fprintf(fp, "file_num: %d ", ts->file_num);
 	//fprintf(fp, "flow_size %d ", ts->flow_size);
 	//fprintf(fp, "file_transfer_time %f ", transfer_time);
 	//fprintf(fp, "flow_rate %f ", ts->flow_size/transfer_time);
-	//fprintf(fp, "ideal_reduce_time %f ", ts->reduce_duration + ts->pkt_delay_duration);
-	if((transfer_time - ts->reduce_duration - ts->pkt_delay_duration)>0){
-		//fprintf(fp, "ideal_rate %f ",ts->flow_size/(transfer_time - ts->reduce_duration - ts->pkt_delay_duration));
+	//fprintf(fp, "ideal_reduce_time %f ", cold->reduce_duration + cold->pkt_delay_duration);
+	if((transfer_time - cold->reduce_duration - cold->pkt_delay_duration)>0){
+		//fprintf(fp, "ideal_rate %f ",ts->flow_size/(transfer_time - cold->reduce_duration - cold->pkt_delay_duration));
 	}else{
 		//fprintf(fp, "ideal_rate %f ",ts->flow_size/transfer_time);
 	}
 	//fprintf(fp, "flow_time: %f ", (ts->last_time - ts->start_time));
 	//fprintf(fp, "total_duration: %f ", ts->total_duration);
 	//fprintf(fp, "ideal_rate: %f ",ts->flow_size/(transfer_time - ts->total_duration));
-	//fprintf(fp, "retrans_duration: %f ", ts->retrans_duration);
-	//fprintf(fp, "rate_without_retrans: %f ",ts->flow_size/(transfer_time - ts->retrans_duration));
-	//fprintf(fp, "reduce_duration: %f ",ts->reduce_duration);
-	//fprintf(fp, "flow_time_reduce_duration: %f ",transfer_time - ts->reduce_duration);
-	//fprintf(fp, "rate_reduce_duration: %f ",ts->flow_size/(transfer_time - ts->reduce_duration));
+	//fprintf(fp, "retrans_duration: %f ", cold->retrans_duration);
+	//fprintf(fp, "rate_without_retrans: %f ",ts->flow_size/(transfer_time - cold->retrans_duration));
+	//fprintf(fp, "reduce_duration: %f ",cold->reduce_duration);
+	//fprintf(fp, "flow_time_reduce_duration: %f ",transfer_time - cold->reduce_duration);
+	//fprintf(fp, "rate_reduce_duration: %f ",ts->flow_size/(transfer_time - cold->reduce_duration));
 	//fprintf(fp, "reset %d ", ts->reset);
 	//fprintf(fp, "avg_srtt %f \n", avg_srtt);
 	double rate;
@@ -597,53 +699,55 @@ void dump_ts_info(FILE *fp, struct tcp_state *ts)
 	{
 		if(ts->pkt_out_cnt > 0)
 			rate = 1.0*ts->retrans_temp/ts->pkt_out_cnt;
-		fprintf(fp,"download pkt_cnt: %d reorder_cnt: %d reorder_rate %f\n", ts->pkt_out_cnt, ts->retrans_temp, rate);
+		out_printf(out, "download pkt_cnt: %d reorder_cnt: %d reorder_rate %f\n", ts->pkt_out_cnt, ts->retrans_temp, rate);
 	}
 	if (file_type == UPLOAD)
 	{
 		if(ts->pkt_out_cnt > 0)
 			rate = 1.0*lost_num/ts->pkt_out_cnt;
-		fprintf(fp,"upload pkt_cnt: %d loss_cnt: %d loss_rate %f\n", ts->pkt_out_cnt, lost_num, rate);
+		out_printf(out, "upload pkt_cnt: %d loss_cnt: %d loss_rate %f\n", ts->pkt_out_cnt, lost_num, rate);
 	}
 }
 
 static void free_tcp_state(struct tcp_state *ts)
 {
-	delete_rtt_list(&ts->rtt_list);
-
-	delete_list(&ts->retrans_list, struct range_t, list);
-	delete_list(&ts->block_list, struct range_t, list);
-	delete_list(&ts->reordering_list, struct range_t, list);
-	delete_list(&ts->spurious_retrans_list, struct range_t, list);
-	delete_list(&ts->lost_list, struct range_t, list);
-	delete_list(&ts->srtt_list, struct range_t, list);
-	
-	delete_list(&ts->stall_list, struct tcp_stall_state, list);
+	// all the list nodes and stall records live in the flow pool
+	pool_release(&ts->cold->pool);
+	delete_range_array(&ts->retrans_list);
+	delete_rtt_ring(&ts->rtt_list);
+	delete_rtt_ring(&ts->send_out_time_list);
 
+	FREE(ts->cold);
 	FREE(ts);
 }
 
 void finish_tcp_state(struct tcp_state *ts)
 {
-	if (ts->max_snd_seg_size != 0) {
-		get_lost_list(ts);
-		get_reord_list(ts);
-
-		fill_tcp_stall_list(ts, &ts->stall_list);
-		FILE *fp = stdout;
+	struct mem_pool *prev = use_pool(&ts->cold->pool);
+	if (ts->max_snd_seg_size != 0 && (output_kinds & OUT_SUMMARY)) {
+		struct flow_ranges *fr = get_flow_ranges(ts);
+		get_lost_list(ts, fr);
+		get_reord_list(ts, fr);
+
+		fill_tcp_stall_list(ts, &ts->cold->stall_list, fr);
+		struct out_stream *out = OUTPUT_STREAM(report_out);
 		// exclude the up_stream
 		//int flow_size = ts->snd_nxt - ts->seq_base;
 		if (ts->in_data_size < 5000000){
 		    //fprintf(fp, "name: %s\n", ts->name);
 		    //fprintf(fp, "#(stalls): %d\n", ts->stall_cnt);
 		    //fprintf(fp,"initial seq number is: %d\n", ts->seq_base);
-		    dump_ts_info(fp, ts);
-		    // dump tss info
-		    //dump_tss_list(fp, &ts->stall_list);
+		    dump_ts_info(out, ts, fr);
+		    // dump tss info, a part of the report
+		    if (stall_rule_num > 0)
+		        dump_tss_list(out, &ts->cold->stall_list);
+		    if (report_hook != NULL)
+		        report_hook(ts);
 		    //printf("%d\n", ts->init_rwnd);
 		    //printf("flow_time %f\n", (ts->last_time - ts->start_time));
 		}
 	}
 
+	use_pool(prev);
 	free_tcp_state(ts);
 }
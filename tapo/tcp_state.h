@@ -4,6 +4,10 @@
 #include "tcp_base.h"
 #include "tcp_options.h"
 #include "tcp_range_list.h"
+#include "tcp_rtt.h"
+#include "malloc.h"
+#include "timer_wheel.h"
+#include "output.h"
 
 #include "def.h"
 
@@ -18,72 +22,89 @@
 #define TCP_CA_RECOVERY 1
 extern const char *tcp_ca_state[];
 
+/*
+ * The fields used by every packet are packed at the front of struct
+ * tcp_state, in the first three cache lines of a line-aligned allocation,
+ * followed by the rings and arrays also touched per packet. Diagnostics,
+ * the loss/reordering lists and the name of the flow are kept in a
+ * separate struct tcp_state_cold, which is read when stalls are recorded
+ * and when the flow is reported.
+ */
+struct tcp_state_cold {
+	// formatted by flow_name() when first needed
+	char name[24];
+
+	uint32_t init_rwnd;
+	uint32_t last_stall_point;
+	nstime_t last_stall_time;
+
+	int file_num;
+	int reset;
+	nstime_t this_transfer_begin_time;
+	nstime_t total_transfer_time;
+	nstime_t total_duration;
+	nstime_t retrans_duration;
+	// seconds, from the stall records
+	double pkt_delay_duration;
+	double reduce_duration;
+
+	struct block_t reord;
+	struct list_head block_list;
+	struct list_head reordering_list;
+	struct list_head spurious_retrans_list;
+	struct list_head stall_list;
+
+	// list nodes and stall records of this flow
+	struct mem_pool pool;
+};
+
+/*
+ * The ranges of a flow being finished, flattened from its lists and
+ * reconciled by linear merges, see get_lost_list() and get_reord_list().
+ * Every thread finishing flows reuses one of these, so a flow is finished
+ * without allocating.
+ */
+struct flow_ranges {
+	struct range_vec block;
+	struct range_vec reord;
+	struct range_vec spurious;
+	struct range_vec lost;
+	// begins of the lost and the spurious ranges, see fill_tcp_stall_list()
+	uint32_t *begins;
+	int begin_cap;
+};
+
 struct tcp_state {
 	struct tcp_key key;
-	char name[128];
-
 	int state; // see /usr/include/netinet/tcp.h
 	uint32_t snd_nxt;
 	uint32_t snd_una;
 	uint32_t rcv_nxt;
 	uint32_t rcv_una;
-
 	uint32_t seq_base;
 	uint32_t max_snd_seg_size;
-	uint32_t flow_size;
-	uint32_t in_data_size;
-
-	int pkt_cnt; // n-th pkt in the flow, for debugging
-	int pkt_in_cnt;
-	int pkt_out_cnt;
-
-	struct tcp_option option;
-	// in options
-	struct sack_block sack;
-	int rwnd_scale;
 	int rwnd;
-	int init_rwnd;
-	int retrans_temp;
-
+	int rwnd_scale;
 	// TCP_CA_OPEN, TCP_CA_RECOVERY
 	int ca_state;
-
-	// time related
-	double start_time;
-	double last_time;
-	double last_in_time;
-	double last_out_time;
-	double this_transfer_begin_time;
-	double total_transfer_time;
-	double total_duration;
-	double retrans_duration;
-	double pkt_delay_duration;
-	double reduce_duration;
-	double arg_srtt;
-
+	uint32_t recovery_point;
 	int last_pkt_dir; // In, Out, Undetermined
+	int tail_burst;
 
+	nstime_t start_time;
+	nstime_t last_time;
+	nstime_t last_in_time;
+	nstime_t last_out_time;
 	struct rtt_t rtt;
-
-	// retransmit
-	uint32_t recovery_point;
-
-	double last_stall_time;
-	uint32_t last_stall_point;
-	uint32_t stall_cnt;
-
-	struct block_t reord;
-
-	struct list_head rtt_list;
-	struct list_head block_list;
-	struct list_head retrans_list;
-	struct list_head reordering_list;
-	struct list_head spurious_retrans_list;
-	struct list_head lost_list;
-	struct list_head send_out_time_list;
-	struct list_head srtt_list;
-
-	struct list_head stall_list;
+	uint32_t flow_size;
+	uint32_t pkt_out_cnt;
+	uint32_t retrans_temp;
+	uint32_t flow_id; // in the binary series, see series_bin.h
+	// indicate whether it's at the beginning/end of a transferring file
+	int8_t head;
+	int8_t tail;
+	// RTT from the timestamp echo, see --rtt
+	int8_t rtt_ts;
 
 	int packets_out;
 	int fackets_out;
@@ -91,18 +112,40 @@ struct tcp_state {
 	int holes;
 	int retrans_out;
 	int outstanding;
-
-	// indicate whether it's at the beginning/end of a transferring file
-	int head;
-	int tail;
-	int file_num;
-	int tail_burst;
-	int reset;
-};
-
-struct tcp_state *new_tcp_state(struct tcp_key *key, double time);
-int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, double cap_time, int dir);
+	uint32_t stall_cnt;
+	uint32_t in_data_size;
+	// of the last incoming packet
+	struct sack_block sack;
+	nstime_t last_snapshot_time;
+	struct tcp_state_cold *cold;
+
+	struct rtt_ring rtt_list;
+	struct rtt_ring send_out_time_list;
+	struct range_array retrans_list;
+
+	// expires the flow when it is idle, see expire_ts_entries()
+	struct timer idle_timer;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Output streams of the calling thread, NULL means stdout. The workers of
+// the sharded engine redirect them to private files, see tcp_worker.c.
+// Per-packet series and snapshots go to series_out, flow reports to
+// report_out. When the series is written to the binary -w file, the text
+// snapshots go to snapshot_out instead.
+extern __thread struct out_stream *series_out;
+extern __thread struct out_stream *report_out;
+extern __thread struct out_stream *snapshot_out;
+// called when a flow report has been written to report_out
+extern __thread void (*report_hook)(struct tcp_state *ts);
+
+#define OUTPUT_STREAM(s) ((s) != NULL ? (s) : &stdout_stream)
+
+struct tcp_state *new_tcp_state(struct tcp_key *key, nstime_t time);
+const char *flow_name(struct tcp_state *ts);
+int tcp_state_machine(struct tcp_state *ts, struct tcphdr *th, int len, nstime_t cap_time, int dir);
 void finish_tcp_state(struct tcp_state *ts);
-void dump_ts_info(FILE *fp, struct tcp_state *ts);
+void dump_ts_info(struct out_stream *out, struct tcp_state *ts, struct flow_ranges *fr);
+// free the flow_ranges of the calling thread before it exits
+void tcp_state_thread_cleanup();
 
 #endif
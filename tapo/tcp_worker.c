@@ -0,0 +1,597 @@
+#include "tcp_worker.h"
+#include "tcp_state.h"
+#include "hash_table.h"
+#include "malloc.h"
+#include "log.h"
+#include "def.h"
+#include "cmd_options.h"
+#include "timer_wheel.h"
+#include "tcp_pcap.h"
+#include "output.h"
+#include "series_bin.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Flow-sharded analysis engine.
+ *
+ * The reader thread (see handle_pcap()) hashes the tcp key of every packet
+ * and hands the packet to one of the workers. Each worker owns a private
+ * flow table, so all the packets of a flow are processed by the same thread
+ * in capture order and no locking is needed around tcp_state.
+ *
+ * Packets are passed in batches through two rings per worker: the reader
+ * takes an empty batch from the free ring, fills it and puts it to the full
+ * ring; the worker consumes full batches and gives them back.
+ *
+ * When idle flows expire, the reader also sends a clock item to every worker
+ * whenever the capture time enters a new wheel tick, so idle flows expire
+ * at the same packet as in the single-threaded mode.
+ *
+ * Outputs of a worker go to private temporary files through its own
+ * output streams. When all the workers are finished, the per-packet series
+ * are copied to stdout in worker order, and the flow reports are merged by
+ * (packet that finished the flow, tcp key), so the report order does not
+ * depend on the number of workers.
+ *
+ * Live captures on a TPACKET_V3 capable interface skip the reader thread:
+ * every worker reads its own ring, and the rings join one fanout group, so
+ * the kernel does the sharding. Packets are then ordered by capture time
+ * instead of by their position in the capture.
+ */
+
+#define BATCH_SIZE 256
+#define QUEUE_DEPTH 64
+// items of a batch whose flow table slots are prefetched ahead
+#define PREFETCH_AHEAD 8
+
+struct pkt_item {
+	uint64_t pkt_seq;
+	struct tcp_key key;
+	nstime_t time;
+	int len;
+	int dir; // DIR_UNDETERMINED for a clock item
+	u_char tcp_hdr[MAX_TCPHDR_LEN];
+};
+
+struct pkt_batch {
+	int num;
+	struct pkt_item items[BATCH_SIZE];
+};
+
+struct batch_ring {
+	struct pkt_batch *slot[QUEUE_DEPTH];
+	int head;
+	int num;
+};
+
+struct flow_report {
+	uint64_t pkt_seq; // the packet finishing the flow, UINT64_MAX at exit
+	struct tcp_key key;
+	int worker;
+	long offset;
+	long len;
+};
+
+struct tcp_worker {
+	int id;
+	pthread_t tid;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct batch_ring full;
+	struct batch_ring free;
+	int done;
+
+	// the batch being filled by the reader
+	struct pkt_batch *cur;
+
+	// live capture ring of the worker, see capture_main()
+	struct tpacket_ring ring;
+
+	struct hash_table *hash_table;
+	uint64_t cur_seq;
+
+	// output goes to temporary files through the streams
+	FILE *series_tmp;
+	FILE *report_tmp;
+	FILE *snapshot_tmp; // only with the binary series of -w
+	struct out_stream series_out;
+	struct out_stream report_out;
+	struct out_stream snapshot_out;
+	long report_off;
+	struct flow_report *reports;
+	int report_num;
+	int report_cap;
+};
+
+static struct tcp_worker *workers = NULL;
+static int worker_cnt = 0;
+static uint64_t last_tick = 0;
+
+// capture workers
+static int capture_mode = 0;
+static volatile int capture_stop = 0;
+static int capture_running = 0;
+static int pkt_total = 0;
+
+static __thread struct tcp_worker *self = NULL;
+
+// ts is the flow of key found while the table was at generation gen
+static int handle_tcp_pkt(struct hash_table *hash_table, struct tcp_key *key,
+		struct tcp_state *ts, uint32_t gen, nstime_t time, struct tcphdr *th, int len, int dir)
+{
+	// LOG(INFO, "time: %lld, len: %d, dir: %d\n", (long long)time, len, dir);
+	expire_ts_entries(hash_table, time);
+
+	// flows came or went since, ts may be gone or missed
+	if (gen != hash_table->gen)
+		ts = find_ts_entry(hash_table, key);
+	if (ts == NULL && IS_SYN(th) && dir == DIR_IN) {
+		ts = new_tcp_state(key, time);
+		insert_ts_entry(hash_table, ts);
+	}
+
+	if (ts != NULL) {
+		tcp_state_machine(ts, th, len, time, dir);
+
+		if (ts->state == TCP_CLOSE || ts->state == TCP_CLOSING) {
+			delete_ts_entry(hash_table, ts);
+			// free_tcp_state(ts);
+			return 1;
+		}
+		//if (IS_SYN(th) && dir == DIR_IN ) {
+		//	delete_ts_entry(hash_table, ts);
+		//	ts = new_tcp_state(key, time);
+		//	insert_ts_entry(hash_table, ts);
+		//}
+	}
+
+	return 0;
+}
+
+int parse_tcp_info(struct hash_table *hash_table, struct tcp_key *key,
+		nstime_t time, struct tcphdr *th, int len, int dir)
+{
+	struct tcp_state *ts = find_ts_entry(hash_table, key);
+	return handle_tcp_pkt(hash_table, key, ts, hash_table->gen, time, th, len, dir);
+}
+
+/*
+ * Handle the first num packets of a batch. The flow table is looked up for
+ * all the packets before any of them is handled, see prefetch_ts_slot().
+ * The flows found are used as long as no flow is inserted or deleted.
+ */
+void parse_tcp_batch(struct hash_table *hash_table, struct pkt_vec *vec, int num)
+{
+	struct tcp_state *ts[PKT_BATCH];
+	int i = 0;
+	for (; i < num; i++)
+		prefetch_ts_slot(hash_table, &vec->key[i]);
+	for (i = 0; i < num; i++)
+		ts[i] = prefetch_ts_entry(hash_table, &vec->key[i]);
+
+	uint32_t gen = hash_table->gen;
+	for (i = 0; i < num; i++)
+		handle_tcp_pkt(hash_table, &vec->key[i], ts[i], gen, vec->time[i],
+				(struct tcphdr *)vec->tcp_hdr[i], vec->len[i], vec->dir[i]);
+}
+
+static inline void ring_push(struct batch_ring *ring, struct pkt_batch *batch)
+{
+	ring->slot[(ring->head + ring->num) % QUEUE_DEPTH] = batch;
+	ring->num += 1;
+}
+
+static inline struct pkt_batch *ring_pop(struct batch_ring *ring)
+{
+	struct pkt_batch *batch = ring->slot[ring->head];
+	ring->head = (ring->head + 1) % QUEUE_DEPTH;
+	ring->num -= 1;
+	return batch;
+}
+
+// FNV-1a, independent from the hash of the flow table
+static inline uint32_t shard_hash(struct tcp_key *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint32_t h = 2166136261u;
+	int i = 0;
+	for (; i < sizeof(struct tcp_key); i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static FILE *new_tmpfile()
+{
+	FILE *fp = tmpfile();
+	if (fp == NULL) {
+		LOG(ERROR, "Could not create temporary file: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	return fp;
+}
+
+// called by finish_tcp_state() after a flow report is written
+static void record_report(struct tcp_state *ts)
+{
+	struct tcp_worker *w = self;
+	long off = out_tell(&w->report_out);
+	if (off == w->report_off)
+		return;
+
+	if (w->report_num == w->report_cap) {
+		w->report_cap = w->report_cap ? w->report_cap*2 : 1024;
+		w->reports = realloc(w->reports, w->report_cap*sizeof(struct flow_report));
+		if (w->reports == NULL) {
+			LOG(ERROR, "realloc flow reports failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	struct flow_report *r = &w->reports[w->report_num++];
+	r->pkt_seq = w->cur_seq;
+	memcpy(&r->key, &ts->key, sizeof(struct tcp_key));
+	r->worker = w->id;
+	r->offset = w->report_off;
+	r->len = off - w->report_off;
+
+	w->report_off = off;
+}
+
+static void *worker_main(void *arg)
+{
+	struct tcp_worker *w = (struct tcp_worker *)arg;
+
+	self = w;
+	series_out = &w->series_out;
+	report_out = &w->report_out;
+	snapshot_out = &w->snapshot_out;
+	report_hook = &record_report;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (w->full.num == 0 && !w->done)
+			pthread_cond_wait(&w->not_empty, &w->lock);
+		if (w->full.num == 0) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		struct pkt_batch *batch = ring_pop(&w->full);
+		pthread_mutex_unlock(&w->lock);
+
+		int i = 0;
+		for (; i < PREFETCH_AHEAD && i < batch->num; i++)
+			prefetch_ts_slot(w->hash_table, &batch->items[i].key);
+
+		for (i = 0; i < batch->num; i++) {
+			struct pkt_item *item = &batch->items[i];
+			if (i + PREFETCH_AHEAD < batch->num)
+				prefetch_ts_slot(w->hash_table, &batch->items[i + PREFETCH_AHEAD].key);
+			w->cur_seq = item->pkt_seq;
+			if (item->dir == DIR_UNDETERMINED) {
+				expire_ts_entries(w->hash_table, item->time);
+				continue;
+			}
+			parse_tcp_info(w->hash_table, &item->key, item->time,
+					(struct tcphdr *)item->tcp_hdr, item->len, item->dir);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		ring_push(&w->free, batch);
+		pthread_cond_signal(&w->not_full);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	// flows still alive at the end of the capture
+	w->cur_seq = UINT64_MAX;
+	cleanup_hash_table(w->hash_table);
+	pool_thread_cleanup();
+	tcp_state_thread_cleanup();
+	series_thread_cleanup(&w->series_out);
+	out_flush(&w->series_out);
+	out_flush(&w->report_out);
+	out_flush(&w->snapshot_out);
+
+	return NULL;
+}
+
+static nstime_t wall_time()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (nstime_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static void *capture_main(void *arg)
+{
+	struct tcp_worker *w = (struct tcp_worker *)arg;
+
+	self = w;
+	series_out = &w->series_out;
+	report_out = &w->report_out;
+	snapshot_out = &w->snapshot_out;
+	report_hook = &record_report;
+
+	struct pcap_pkthdr pph;
+	const u_char *packet;
+	while (!capture_stop) {
+		packet = tpacket_next(&w->ring, &pph, TPACKET_BLOCK_TIMEOUT);
+		if (packet == NULL) {
+			// no traffic, idle flows expire in wall clock time
+			if (idle_timeout > 0) {
+				expire_ts_entries(w->hash_table, wall_time());
+			}
+			continue;
+		}
+
+		if (pcap_limit > 0 && __sync_add_and_fetch(&pkt_total, 1) >= pcap_limit) {
+			capture_stop = 1;
+			break;
+		}
+
+		nstime_t time = pkt_time(&pph.ts);
+		int dir, payload_len;
+		struct tcp_key key;
+		struct tcphdr *tcp_hdr = get_tcp_hdr(packet, pph.caplen, &key, &payload_len, &dir);
+		if (tcp_hdr == NULL)
+			continue;
+
+		w->cur_seq = time;
+		parse_tcp_info(w->hash_table, &key, time, tcp_hdr, payload_len, dir);
+	}
+
+	w->cur_seq = UINT64_MAX;
+	cleanup_hash_table(w->hash_table);
+	pool_thread_cleanup();
+	tcp_state_thread_cleanup();
+	series_thread_cleanup(&w->series_out);
+	out_flush(&w->series_out);
+	out_flush(&w->report_out);
+	out_flush(&w->snapshot_out);
+	tpacket_close(&w->ring);
+	__sync_sub_and_fetch(&capture_running, 1);
+
+	return NULL;
+}
+
+static void init_worker(struct tcp_worker *w, int id)
+{
+	w->id = id;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->not_empty, NULL);
+	pthread_cond_init(&w->not_full, NULL);
+
+	w->hash_table = new_hash_table();
+	w->series_tmp = new_tmpfile();
+	w->report_tmp = new_tmpfile();
+	out_stream_init(&w->series_out, fileno(w->series_tmp));
+	out_stream_init(&w->report_out, fileno(w->report_tmp));
+	if (series_file != NULL) {
+		w->snapshot_tmp = new_tmpfile();
+		out_stream_init(&w->snapshot_out, fileno(w->snapshot_tmp));
+	}
+}
+
+static void start_worker(struct tcp_worker *w, void *(*fn)(void *))
+{
+	if (pthread_create(&w->tid, NULL, fn, w) != 0) {
+		LOG(ERROR, "Could not create worker thread %d\n", w->id);
+		exit(1);
+	}
+}
+
+void init_workers(int num)
+{
+	worker_cnt = num;
+	workers = MALLOC_N(struct tcp_worker, num);
+
+	int i = 0, j = 0;
+	for (; i < num; i++) {
+		struct tcp_worker *w = &workers[i];
+		init_worker(w, i);
+		for (j = 0; j < QUEUE_DEPTH; j++)
+			ring_push(&w->free, MALLOC(struct pkt_batch));
+		start_worker(w, worker_main);
+	}
+}
+
+/*
+ * The kernel shards by the number of sockets in the fanout group, so the
+ * packets captured while the group is still growing may go to another
+ * worker than the rest of their flow. They are dropped.
+ */
+void init_capture_workers(int num)
+{
+	worker_cnt = num;
+	workers = MALLOC_N(struct tcp_worker, num);
+	capture_mode = 1;
+
+	int i = 0, fanout_id = getpid() & 0xffff;
+	for (; i < num; i++) {
+		init_worker(&workers[i], i);
+		if (pcap_open_ring(&workers[i].ring, fanout_id) != 0)
+			exit(1);
+	}
+
+	nstime_t since = wall_time();
+	capture_running = num;
+	for (i = 0; i < num; i++) {
+		workers[i].ring.since = since;
+		start_worker(&workers[i], capture_main);
+	}
+}
+
+int capture_finished()
+{
+	return capture_stop || capture_running == 0;
+}
+
+static void submit_batch(struct tcp_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	ring_push(&w->full, w->cur);
+	w->cur = NULL;
+	pthread_cond_signal(&w->not_empty);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static struct pkt_item *new_item(struct tcp_worker *w)
+{
+	if (w->cur == NULL) {
+		pthread_mutex_lock(&w->lock);
+		while (w->free.num == 0)
+			pthread_cond_wait(&w->not_full, &w->lock);
+		w->cur = ring_pop(&w->free);
+		pthread_mutex_unlock(&w->lock);
+		w->cur->num = 0;
+	}
+
+	return &w->cur->items[w->cur->num++];
+}
+
+static void send_clock(uint64_t pkt_seq, nstime_t time)
+{
+	int i = 0;
+	for (; i < worker_cnt; i++) {
+		struct tcp_worker *w = &workers[i];
+		struct pkt_item *item = new_item(w);
+		item->pkt_seq = pkt_seq;
+		item->time = time;
+		item->dir = DIR_UNDETERMINED;
+
+		if (w->cur->num == BATCH_SIZE)
+			submit_batch(w);
+	}
+}
+
+void dispatch_pkt(uint64_t pkt_seq, struct tcp_key *key, nstime_t time,
+		struct tcphdr *th, int len, int dir)
+{
+	if (idle_timeout > 0 && TIME_TO_WHEEL_TICK(time) != last_tick) {
+		last_tick = TIME_TO_WHEEL_TICK(time);
+		send_clock(pkt_seq, time);
+	}
+
+	struct tcp_worker *w = &workers[shard_hash(key) % worker_cnt];
+	struct pkt_item *item = new_item(w);
+	item->pkt_seq = pkt_seq;
+	memcpy(&item->key, key, sizeof(struct tcp_key));
+	item->time = time;
+	item->len = len;
+	item->dir = dir;
+	memcpy(item->tcp_hdr, th, th->doff*4);
+
+	if (w->cur->num == BATCH_SIZE)
+		submit_batch(w);
+}
+
+static int cmp_report(const void *a, const void *b)
+{
+	const struct flow_report *ra = (const struct flow_report *)a,
+		  *rb = (const struct flow_report *)b;
+	if (ra->pkt_seq != rb->pkt_seq)
+		return ra->pkt_seq < rb->pkt_seq ? -1 : 1;
+
+	int c = memcmp(&ra->key, &rb->key, sizeof(struct tcp_key));
+	if (c != 0)
+		return c;
+
+	// the same flow reopened in one worker
+	return ra->offset < rb->offset ? -1 : (ra->offset > rb->offset);
+}
+
+static void copy_file(struct out_stream *dst, int fd, long offset, long len)
+{
+	char buf[65536];
+	while (len != 0) {
+		size_t n = sizeof(buf);
+		if (len > 0 && n > len)
+			n = len;
+		ssize_t r = pread(fd, buf, n, offset);
+		if (r <= 0)
+			break;
+		out_write(dst, buf, r);
+		offset += r;
+		if (len > 0)
+			len -= r;
+	}
+}
+
+void cleanup_workers()
+{
+	int i = 0, total = 0;
+	capture_stop = 1;
+	for (; !capture_mode && i < worker_cnt; i++) {
+		struct tcp_worker *w = &workers[i];
+		if (w->cur != NULL)
+			submit_batch(w);
+		pthread_mutex_lock(&w->lock);
+		w->done = 1;
+		pthread_cond_signal(&w->not_empty);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	for (i = 0; i < worker_cnt; i++) {
+		pthread_join(workers[i].tid, NULL);
+		total += workers[i].report_num;
+	}
+	// the temporary files are complete
+	out_sync();
+
+	// per-packet series, the blocks of the binary series are self-contained
+	struct out_stream *series = series_file ? series_file : &stdout_stream;
+	for (i = 0; i < worker_cnt; i++)
+		copy_file(series, fileno(workers[i].series_tmp), 0, -1);
+	// the text snapshots kept out of the binary series
+	for (i = 0; series_file != NULL && i < worker_cnt; i++)
+		copy_file(&stdout_stream, fileno(workers[i].snapshot_tmp), 0, -1);
+
+	// merge the flow reports
+	struct flow_report *all = NULL;
+	if (total > 0) {
+		all = MALLOC_N(struct flow_report, total);
+		int n = 0;
+		for (i = 0; i < worker_cnt; i++) {
+			if (workers[i].report_num == 0)
+				continue;
+			memcpy(all+n, workers[i].reports, workers[i].report_num*sizeof(struct flow_report));
+			n += workers[i].report_num;
+		}
+		qsort(all, total, sizeof(struct flow_report), cmp_report);
+
+		for (i = 0; i < total; i++)
+			copy_file(&stdout_stream, fileno(workers[all[i].worker].report_tmp),
+					all[i].offset, all[i].len);
+		FREE_N(all);
+	}
+	out_flush(&stdout_stream);
+
+	for (i = 0; i < worker_cnt; i++) {
+		struct tcp_worker *w = &workers[i];
+		while (w->free.num > 0)
+			FREE(ring_pop(&w->free));
+		fclose(w->series_tmp);
+		fclose(w->report_tmp);
+		if (w->snapshot_tmp != NULL)
+			fclose(w->snapshot_tmp);
+		free(w->reports);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->not_empty);
+		pthread_cond_destroy(&w->not_full);
+	}
+	FREE_N(workers);
+	workers = NULL;
+	worker_cnt = 0;
+	capture_mode = 0;
+}
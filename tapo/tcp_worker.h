@@ -0,0 +1,22 @@
+#ifndef __TCP_WORKER_H__
+#define __TCP_WORKER_H__
+
+#include "tcp_base.h"
+#include "hash_table.h"
+#include "tcp_pcap.h"
+
+#include <stdint.h>
+#include <netinet/tcp.h>
+
+int parse_tcp_info(struct hash_table *hash_table, struct tcp_key *key,
+		nstime_t time, struct tcphdr *th, int len, int dir);
+void parse_tcp_batch(struct hash_table *hash_table, struct pkt_vec *vec, int num);
+
+void init_workers(int num);
+void dispatch_pkt(uint64_t pkt_seq, struct tcp_key *key, nstime_t time,
+		struct tcphdr *th, int len, int dir);
+void init_capture_workers(int num);
+int capture_finished();
+void cleanup_workers();
+
+#endif
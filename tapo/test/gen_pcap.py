@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+# Write a capture of a few downloads from 10.0.0.1:80, with losses and
+# retransmissions, spread over some seconds of capture time.
+import struct, sys
+
+SRV, SPORT = bytes([10, 0, 0, 1]), 80
+ACK, PSH, SYN, FIN = 16, 8, 2, 1
+pkts = []
+
+def packet(t, src, dst, sport, dport, seq, ack, flags, payload):
+	tcp = struct.pack('!HHIIBBHHH', sport, dport, seq & 0xffffffff, ack & 0xffffffff,
+			5 << 4, flags, 65535, 0, 0)
+	ip = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 40 + payload, 0, 0, 64, 6, 0, src, dst)
+	frame = b'\0' * 12 + b'\x08\x00' + ip + tcp
+	pkts.append((t, frame, len(frame) + payload))
+
+def download(cli, cport, t, segs, mss=1000):
+	cseq, sseq = 1000, 5000
+	packet(t, cli, SRV, cport, SPORT, cseq, 0, SYN, 0)
+	packet(t + 0.01, SRV, cli, SPORT, cport, sseq, cseq + 1, SYN | ACK, 0)
+	packet(t + 0.02, cli, SRV, cport, SPORT, cseq + 1, sseq + 1, ACK, 0)
+	t += 0.03
+	base = sseq + 1
+	for i in range(segs):
+		packet(t, SRV, cli, SPORT, cport, base + i * mss, cseq + 1, ACK | PSH, mss)
+		t += 0.01
+		if i % 7 == 3:
+			# lost, retransmitted after a stall
+			t += 0.3
+			packet(t, SRV, cli, SPORT, cport, base + i * mss, cseq + 1, ACK | PSH, mss)
+			t += 0.01
+		packet(t, cli, SRV, cport, SPORT, cseq + 1, base + (i + 1) * mss, ACK, 0)
+		t += 0.01
+	packet(t, SRV, cli, SPORT, cport, base + segs * mss, cseq + 1, FIN | ACK, 0)
+	packet(t + 0.01, cli, SRV, cport, SPORT, cseq + 1, base + segs * mss + 1, FIN | ACK, 0)
+
+for n in range(4):
+	download(bytes([10, 0, 1, n + 2]), 40000 + n, 1.0 + n * 0.5, 100)
+pkts.sort(key=lambda p: p[0])
+
+with open(sys.argv[1], 'wb') as f:
+	f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+	for t, frame, wire in pkts:
+		f.write(struct.pack('<IIII', int(t), int(t * 1e6) % 1000000, len(frame), wire))
+		f.write(frame)
@@ -0,0 +1,31 @@
+#!/bin/sh
+# The binary series of -w must stay readable when snapshots are on: they
+# go to stdout, the rows read back are those written without snapshots.
+# Run from tapo/ after make, see `make check'.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+python3 test/gen_pcap.py "$dir/cap.pcap"
+./tcp_tool -f "$dir/cap.pcap" -s 10.0.0.1 -p 80 -w "$dir/plain.bin" -O series > /dev/null
+./reader/series_reader "$dir/plain.bin" > "$dir/plain.rows"
+
+for j in 1 2; do
+	./tcp_tool -f "$dir/cap.pcap" -s 10.0.0.1 -p 80 -j $j -w "$dir/snap.bin" \
+		-O series,snapshot,summary -I 1 > "$dir/snap.out"
+	if ! grep -q '^snapshot ' "$dir/snap.out"; then
+		echo "FAIL -j $j: no snapshots on stdout"
+		exit 1
+	fi
+	if grep -aq 'snapshot' "$dir/snap.bin"; then
+		echo "FAIL -j $j: snapshots in the series file"
+		exit 1
+	fi
+	./reader/series_reader "$dir/snap.bin" > "$dir/snap.rows"
+	# the blocks of the workers may come in another order
+	if ! [ "$(sort "$dir/snap.rows")" = "$(sort "$dir/plain.rows")" ]; then
+		echo "FAIL -j $j: series rows differ"
+		exit 1
+	fi
+done
+echo "series_snapshot: OK"
@@ -0,0 +1,96 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+#define LEVEL_SHIFT(level) (WHEEL_BITS*(level))
+#define MAX_TIMEOUT (((uint64_t)1 << LEVEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+void init_timer_wheel(struct timer_wheel *tw)
+{
+	memset(tw, 0, sizeof(struct timer_wheel));
+
+	int i, j;
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SLOTS; j++)
+			init_list_head(&tw->slots[i][j]);
+}
+
+static void __add_timer(struct timer_wheel *tw, struct timer *t)
+{
+	uint64_t expire = t->expire;
+	if (expire < tw->next)
+		expire = tw->next;
+	else if (expire - tw->next > MAX_TIMEOUT)
+		expire = tw->next + MAX_TIMEOUT;
+
+	uint64_t delta = expire - tw->next;
+	int level = 0;
+	while (level < WHEEL_LEVELS-1 && delta >= ((uint64_t)1 << LEVEL_SHIFT(level+1)))
+		level += 1;
+
+	int idx = (expire >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+	list_add_tail(&t->list, &tw->slots[level][idx]);
+}
+
+void add_timer(struct timer_wheel *tw, struct timer *t)
+{
+	__add_timer(tw, t);
+	tw->num += 1;
+}
+
+void del_timer(struct timer_wheel *tw, struct timer *t)
+{
+	list_delete_entry(&t->list);
+	t->list.next = t->list.prev = NULL;
+	tw->num -= 1;
+}
+
+// re-add the timers of the current slot of the level, return the slot index
+static int cascade(struct timer_wheel *tw, int level)
+{
+	int idx = (tw->next >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+	struct list_head *slot = &tw->slots[level][idx];
+	struct list_head *p = slot->next, *t;
+
+	init_list_head(slot);
+	while (p != slot) {
+		t = p;
+		p = p->next;
+		__add_timer(tw, list_entry(t, struct timer, list));
+	}
+
+	return idx;
+}
+
+/*
+ * Process the ticks up to now (including). The expired timers are moved to
+ * the expired list and are not pending any more.
+ */
+void advance_timer_wheel(struct timer_wheel *tw, uint64_t now, struct list_head *expired)
+{
+	if (!tw->started) {
+		tw->started = 1;
+		tw->next = now + 1;
+		return;
+	}
+
+	while (tw->next <= now) {
+		if (tw->num == 0) {
+			tw->next = now + 1;
+			break;
+		}
+
+		int idx = tw->next & WHEEL_MASK;
+		if (idx == 0 && cascade(tw, 1) == 0 && cascade(tw, 2) == 0)
+			cascade(tw, 3);
+
+		struct list_head *slot = &tw->slots[0][idx];
+		while (!list_empty(slot)) {
+			struct timer *t = list_entry(slot->next, struct timer, list);
+			del_timer(tw, t);
+			list_add_tail(&t->list, expired);
+		}
+
+		tw->next += 1;
+	}
+}
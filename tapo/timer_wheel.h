@@ -0,0 +1,41 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include "list.h"
+
+/*
+ * Hierarchical timer wheel (4 levels of 256 slots), ticks of
+ * WHEEL_TICK_MS milliseconds of capture time. Adding and deleting a timer
+ * is O(1); timers of the upper levels are cascaded down when the lower
+ * level wraps around.
+ */
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+// from nanoseconds
+#define TIME_TO_WHEEL_TICK(t) ((uint64_t)(t) / (WHEEL_TICK_MS * 1000000ULL))
+
+struct timer {
+	struct list_head list;
+	uint64_t expire; // in wheel ticks
+};
+
+struct timer_wheel {
+	int started;
+	int num;
+	uint64_t next; // the next tick to process
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+#define timer_pending(t) ((t)->list.next != NULL)
+
+void init_timer_wheel(struct timer_wheel *tw);
+void add_timer(struct timer_wheel *tw, struct timer *t);
+void del_timer(struct timer_wheel *tw, struct timer *t);
+void advance_timer_wheel(struct timer_wheel *tw, uint64_t now, struct list_head *expired);
+
+#endif